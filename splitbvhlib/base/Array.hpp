@@ -82,6 +82,7 @@ public:
     inline void         compact     (void);                             // Shrinks the allocation to the match the current size. Does not modify contents.
     inline void         set         (const T* ptr, S size);             // Discards old contents, and re-initializes the ArrayBase from the given memory location.
     inline void         set         (const ArrayBase<T,S>& other);      // Discards old contents, and re-initializes the ArrayBase by cloning the given ArrayBase.
+    inline void         swap        (ArrayBase<T,S>& other);            // Exchanges contents and allocations with the given ArrayBase. Does not copy or allocate.
 
     // ArrayBase-wide operations that can only grow the allocation.
 
@@ -356,6 +357,15 @@ template <class T, typename S> void ArrayBase<T,S>::set(const ArrayBase<T,S>& ot
 
 //------------------------------------------------------------------------
 
+template <class T, typename S> void ArrayBase<T,S>::swap(ArrayBase<T,S>& other)
+{
+    FW::swap(m_ptr, other.m_ptr);
+    FW::swap(m_size, other.m_size);
+    FW::swap(m_alloc, other.m_alloc);
+}
+
+//------------------------------------------------------------------------
+
 template <class T, typename S> void ArrayBase<T,S>::clear(void)
 {
     m_size = 0;
@@ -0,0 +1,83 @@
+#include "AsyncBVHBuilder.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+AsyncBVHBuilder::AsyncBVHBuilder(SceneBVH* scene, const Platform& platform, const BVH::BuildParams& params)
+:   m_scene         (scene->getTriVtxIndexBufferPtr(), scene->getVtxPosBufferPtr(), scene->getNumTriangles(), scene->getNumVertices()),
+    m_platform      (platform),
+    m_params        (params),
+    m_userParams    (params),
+    m_bvh           (NULL),
+    m_progress      (0.0f),
+    m_duplicates    (0.0f),
+    m_finished      (false),
+    m_cancel        (false)
+{
+    // Route stats, progress and cancellation through the handle.
+    // The user's progress callback is still called, from the build thread.
+    // Stats are only collected if the caller asked for them.
+
+    if (m_userParams.stats)
+        m_params.stats      = &m_stats;
+    m_params.progressFunc   = progressFunc;
+    m_params.progressData   = this;
+    m_params.cancel         = &m_cancel;
+
+    m_thread.start(threadFunc, this);
+}
+
+//------------------------------------------------------------------------
+
+AsyncBVHBuilder::~AsyncBVHBuilder(void)
+{
+    cancel();
+    m_thread.join();
+    delete m_bvh;
+}
+
+//------------------------------------------------------------------------
+
+BVH* AsyncBVHBuilder::wait(void)
+{
+    m_thread.join();
+    BVH* bvh = m_bvh;
+    m_bvh = NULL;
+    return bvh;
+}
+
+//------------------------------------------------------------------------
+
+void AsyncBVHBuilder::threadFunc(void* param)
+{
+    AsyncBVHBuilder* build = (AsyncBVHBuilder*)param;
+    BVH* bvh = new BVH(&build->m_scene, build->m_platform, build->m_params);
+
+    // Cancelled => the tree is incomplete, discard it.
+
+    if (build->m_cancel)
+    {
+        delete bvh;
+        bvh = NULL;
+    }
+    else if (build->m_userParams.stats)
+        *build->m_userParams.stats = build->m_stats;
+
+    build->m_bvh = bvh;
+    build->m_finished = true;
+}
+
+//------------------------------------------------------------------------
+
+void AsyncBVHBuilder::progressFunc(void* data, F32 progress, F32 duplicates)
+{
+    AsyncBVHBuilder* build = (AsyncBVHBuilder*)data;
+    build->m_progress = progress;
+    build->m_duplicates = duplicates;
+
+    if (build->m_userParams.progressFunc)
+        build->m_userParams.progressFunc(build->m_userParams.progressData, progress, duplicates);
+}
+
+//------------------------------------------------------------------------
@@ -0,0 +1,62 @@
+#pragma once
+#include "BVH.hpp"
+#include "base/Thread.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Builds a BVH on a separate thread:
+//
+//   AsyncBVHBuilder* build = new AsyncBVHBuilder(&scene, platform, params);
+//   ...
+//   if (newerScanArrived)
+//       build->cancel();
+//   ...
+//   BVH* bvh = build->wait();   // NULL if cancelled.
+//   delete build;
+//
+// The vertex and index buffers of the scene must stay alive until the
+// build has finished. Destroying the handle cancels the build, and frees
+// the BVH unless it has been claimed with wait().
+//------------------------------------------------------------------------
+
+class AsyncBVHBuilder
+{
+public:
+                            AsyncBVHBuilder     (SceneBVH* scene, const Platform& platform, const BVH::BuildParams& params);
+                            ~AsyncBVHBuilder    (void);
+
+    F32                     getProgress         (void) const    { return m_progress; }     // Percentage.
+    F32                     getDuplicates       (void) const    { return m_duplicates; }   // Percentage.
+    bool                    isFinished          (void) const    { return m_finished; }
+    bool                    isCancelled         (void) const    { return m_cancel; }
+    const BVH::Stats&       getStats            (void) const    { FW_ASSERT(m_finished); return m_stats; } // Empty unless params.stats was set.
+
+    void                    cancel              (void)          { m_cancel = true; }
+    BVH*                    wait                (void);         // Blocks until finished. The caller takes ownership of the result.
+
+private:
+    static void             threadFunc          (void* param);
+    static void             progressFunc        (void* data, F32 progress, F32 duplicates);
+
+private:
+                            AsyncBVHBuilder     (const AsyncBVHBuilder&); // forbidden
+    AsyncBVHBuilder&        operator=           (const AsyncBVHBuilder&); // forbidden
+
+private:
+    SceneBVH                m_scene;
+    Platform                m_platform;
+    BVH::BuildParams        m_params;
+    BVH::BuildParams        m_userParams;
+
+    Thread                  m_thread;
+    BVH*                    m_bvh;
+    BVH::Stats              m_stats;
+    volatile F32            m_progress;
+    volatile F32            m_duplicates;
+    volatile bool           m_finished;
+    volatile bool           m_cancel;
+};
+
+//------------------------------------------------------------------------
+}
@@ -27,43 +27,310 @@
 
 #include "BVH.hpp"
 #include "SplitBVHBuilder.hpp"
+#include "BinnedBVHBuilder.hpp"
+#include "ProgressiveBVHBuilder.hpp"
+#include "SampleRays.hpp"
+#include "TreeStats.hpp"
+#include "BVHBuildContext.hpp"
+#include "base/MulticoreLauncher.hpp"
 
 using namespace FW;
 
-BVH::BVH(SceneBVH* scene, const Platform& platform, const BuildParams& params)
+namespace
+{
+
+// Gathers and remaps for reorderToLeafOrder(), one chunk of each array per task.
+
+enum { ReorderChunkSize = 1 << 16 };
+
+struct ReorderData
+{
+    const Vec3i*    srcTris;
+    const Vec3f*    srcVerts;
+    const S32*      triPermutation;
+    const S32*      vtxPermutation;
+    const S32*      triRemap;       // original triangle index => new
+    const S32*      vtxRemap;       // original vertex index => new
+    Vec3i*          dstTris;
+    Vec3f*          dstVerts;
+    S32*            triIndices;
+    S32             numTris;
+    S32             numVerts;
+    S32             numTriIndices;
+};
+
+void reorderTask(MulticoreLauncher::Task& task)
+{
+    const ReorderData& d = *(const ReorderData*)task.data;
+    S32 start = task.idx * ReorderChunkSize;
+
+    for (S32 i = start; i < min(start + ReorderChunkSize, d.numTris); i++)
+    {
+        const Vec3i& tri = d.srcTris[d.triPermutation[i]];
+        d.dstTris[i] = Vec3i(d.vtxRemap[tri.x], d.vtxRemap[tri.y], d.vtxRemap[tri.z]);
+    }
+
+    for (S32 i = start; i < min(start + ReorderChunkSize, d.numVerts); i++)
+        d.dstVerts[i] = d.srcVerts[d.vtxPermutation[i]];
+
+    for (S32 i = start; i < min(start + ReorderChunkSize, d.numTriIndices); i++)
+        d.triIndices[i] = d.triRemap[d.triIndices[i]];
+}
+
+}
+
+BVH::BVH(SceneBVH* scene, const Platform& platform, const BuildParams& params, BVHBuildContext* context)
+:   m_platform(platform)
 {
     FW_ASSERT(scene);
+    FW_ASSERT(!context || (!params.progressive && params.earlySplit <= 0.0f)); // Only the split builder uses a context.
 	m_scene = new SceneBVH(scene->getTriVtxIndexBufferPtr(), scene->getVtxPosBufferPtr(), scene->getNumTriangles(), scene->getNumVertices());
-    m_platform = platform;
+    m_refiner = NULL;
+    m_numTreelets = 0;
 
     if (params.enablePrints)
         printf("BVH builder: %d tris, %d vertices\n", scene->getNumTriangles(), scene->getNumVertices());
 
-    m_root = SplitBVHBuilder(*this, params).run();
+    if (params.progressive)
+    {
+        m_refiner = new ProgressiveBVHBuilder(*this, params);
+        m_root = m_refiner->run();
+    }
+    else if (params.earlySplit > 0.0f)
+        m_root = BinnedBVHBuilder(*this, params).run();
+    else if (!context)
+        m_root = SplitBVHBuilder(*this, params).run();
+    else
+    {
+        // Build into the memory recycled from previous builds.
+
+        m_triIndices.swap(context->getTriIndices());
+        m_nodeArena.swap(context->getNodeArena());
+        m_triIndices.clear();
+        m_nodeArena.clear();
+        m_root = SplitBVHBuilder(*this, params, &context->getSplitScratch(), &m_nodeArena).run();
+    }
 
     if (params.enablePrints)
         printf("BVH: Scene bounds: (%.1f,%.1f,%.1f) - (%.1f,%.1f,%.1f)\n", m_root->m_bounds.min().x, m_root->m_bounds.min().y, m_root->m_bounds.min().z,
                                                                            m_root->m_bounds.max().x, m_root->m_bounds.max().y, m_root->m_bounds.max().z);
 
+    // One parallel pass fills the stats and the node probabilities.
+    // With sample rays, the reported cost uses the same weights as the builder.
+
+    bool rayWeighted = (params.sampleRays && params.numSampleRays);
     float sah = 0.f;
-    m_root->computeSubtreeProbabilities(m_platform, 1.f, sah);
+    if (params.stats)
+    {
+        computeTreeStats(*this, *params.stats);
+        sah = params.stats->SAHCost;
+    }
+    else if (!rayWeighted)
+        m_root->computeSubtreeProbabilities(m_platform, 1.f, sah);
+
+    if (rayWeighted)
+    {
+        sah = computeRayWeightedSAH(m_root, m_platform, params.sampleRays, params.numSampleRays, params.rayWeight);
+        if (params.stats)
+            params.stats->SAHCost = sah;
+    }
+
     if (params.enablePrints)
         printf("top-down sah: %.2f\n", sah);
 
-    if(params.stats)
+    // Stats above describe the coarse tree of a progressive build.
+
+    if (m_refiner)
+        m_refiner->start();
+}
+
+BVH::~BVH(void)
+{
+    delete m_refiner; // Stops refinement and frees the replaced leaves.
+    if (m_root && m_nodeArena.isEmpty()) m_root->deleteSubtree();
+    if (m_scene) delete m_scene;
+}
+
+bool BVH::isRefining(void) const
+{
+    return (m_refiner && !m_refiner->isFinished());
+}
+
+bool BVH::waitForRefinement(void)
+{
+    return (!m_refiner || m_refiner->wait());
+}
+
+void BVH::stopRefinement(void)
+{
+    if (m_refiner)
+        m_refiner->stop();
+}
+
+S32 BVH::assignTreelets(S32 maxNodes)
+{
+    FW_ASSERT(maxNodes > 0);
+
+    // Each treelet takes nodes breadth first from its root until it is full.
+    // The nodes left on its queue become the roots of further treelets.
+
+    Array<BVHNode*> roots(m_root);
+    Array<BVHNode*> queue;
+    m_numTreelets = 0;
+
+    for (int i = 0; i < roots.getSize(); i++)
+    {
+        queue.clear();
+        queue.add(roots[i]);
+        S32 numNodes = 0;
+
+        for (int j = 0; j < queue.getSize(); j++)
+        {
+            BVHNode* node = queue[j];
+            if (numNodes == maxNodes)
+            {
+                roots.add(node);
+                continue;
+            }
+
+            node->m_treelet = m_numTreelets;
+            numNodes++;
+            for (int c = 0; c < node->getNumChildNodes(); c++)
+                queue.add(node->getChildNode(c));
+        }
+        m_numTreelets++;
+    }
+    return m_numTreelets;
+}
+
+void BVH::reorderToLeafOrder(LeafOrderedScene& out)
+{
+    // Leaves must not be swapped in while the indices are rewritten.
+
+    stopRefinement();
+
+    const Vec3i* srcTris = m_scene->getTriVtxIndexBufferPtr();
+    const Vec3f* srcVerts = m_scene->getVtxPosBufferPtr();
+    S32 numTris = m_scene->getNumTriangles();
+    S32 numVerts = m_scene->getNumVertices();
+
+    // Number the triangles by their first reference. Spatial splits
+    // reference a triangle from several leaves; it goes with the first one.
+    // These passes are sequential by nature, but touch only indices.
+
+    Array<S32> triRemap;
+    triRemap.reset(numTris);
+    memset(triRemap.getPtr(), -1, numTris * sizeof(S32));
+    out.triPermutation.clear();
+    out.triPermutation.setCapacity(numTris);
+
+    for (int i = 0; i < m_triIndices.getSize(); i++)
     {
-        params.stats->SAHCost           = sah;
-        params.stats->branchingFactor   = 2;
-        params.stats->numLeafNodes      = m_root->getSubtreeSize(BVH_STAT_LEAF_COUNT);
-        params.stats->numInnerNodes     = m_root->getSubtreeSize(BVH_STAT_INNER_COUNT);
-        params.stats->numTris           = m_root->getSubtreeSize(BVH_STAT_TRIANGLE_COUNT);
-        params.stats->numChildNodes     = m_root->getSubtreeSize(BVH_STAT_CHILDNODE_COUNT);
+        S32 tri = m_triIndices[i];
+        if (triRemap[tri] == -1)
+        {
+            triRemap[tri] = out.triPermutation.getSize();
+            out.triPermutation.add(tri);
+        }
+    }
+
+    // Keep the triangles the builder dropped, so that the mesh stays complete.
+
+    for (int i = 0; i < numTris; i++)
+    {
+        if (triRemap[i] == -1)
+        {
+            triRemap[i] = out.triPermutation.getSize();
+            out.triPermutation.add(i);
+        }
+    }
+
+    // Number the vertices by their first use in the new triangle order.
+
+    Array<S32> vtxRemap;
+    vtxRemap.reset(numVerts);
+    memset(vtxRemap.getPtr(), -1, numVerts * sizeof(S32));
+    out.vtxPermutation.clear();
+    out.vtxPermutation.setCapacity(numVerts);
+
+    for (int i = 0; i < numTris; i++)
+    {
+        const Vec3i& tri = srcTris[out.triPermutation[i]];
+        for (int j = 0; j < 3; j++)
+        {
+            if (vtxRemap[tri[j]] == -1)
+            {
+                vtxRemap[tri[j]] = out.vtxPermutation.getSize();
+                out.vtxPermutation.add(tri[j]);
+            }
+        }
     }
+
+    // Gather the buffers and remap the triangle indices in parallel.
+
+    out.triVtxIndex.reset(numTris);
+    out.vtxPos.reset(out.vtxPermutation.getSize());
+
+    ReorderData data;
+    data.srcTris        = srcTris;
+    data.srcVerts       = srcVerts;
+    data.triPermutation = out.triPermutation.getPtr();
+    data.vtxPermutation = out.vtxPermutation.getPtr();
+    data.triRemap       = triRemap.getPtr();
+    data.vtxRemap       = vtxRemap.getPtr();
+    data.dstTris        = out.triVtxIndex.getPtr();
+    data.dstVerts       = out.vtxPos.getPtr();
+    data.triIndices     = m_triIndices.getPtr();
+    data.numTris        = numTris;
+    data.numVerts       = out.vtxPos.getSize();
+    data.numTriIndices  = m_triIndices.getSize();
+
+    S32 numItems = max(max(numTris, data.numVerts), data.numTriIndices);
+    MulticoreLauncher().push(reorderTask, &data, 0, (numItems + ReorderChunkSize - 1) / ReorderChunkSize).popAll();
+
+    delete m_scene;
+    m_scene = new SceneBVH(out.triVtxIndex.getPtr(), out.vtxPos.getPtr(), out.triVtxIndex.getSize(), out.vtxPos.getSize());
 }
 
-static int currentTreelet;
 static Set<int> uniqueTreelets;
 
+void BVH::trace(Ray& ray, RayResult& result, bool needClosestHit, RayStats* stats, bool watertight) const
+{
+    // Treelet tracking is per ray, so any number of threads may trace at once.
+
+    S32 currentTreelet = -2;
+    result.clear();
+
+#if FW_RAY_STATS
+    S32 numNodeTests = 0;
+    S32 numTriangleTests = 0;
+    if(stats)
+    {
+        if(!stats->numRays)
+            stats->platform = m_platform;
+        stats->numRays++;
+        for(int i=stats->treeletAccesses.getSize();i<m_numTreelets;i++)
+            stats->treeletAccesses.add(0);
+        numNodeTests = stats->numNodeTests;
+        numTriangleTests = stats->numTriangleTests;
+    }
+#endif
+
+    // Watertight => conservative box tests, or grazing rays could be culled
+    // before they reach the triangle test.
+
+    PrecomputedRay setup(ray, watertight);
+    traceRecursive(m_root, ray, setup, result, needClosestHit, watertight, currentTreelet, stats);
+
+#if FW_RAY_STATS
+    if(stats)
+    {
+        stats->nodeTestHistogram[min(stats->numNodeTests - numNodeTests, (S32)RayStats::NumHistogramBins - 1)]++;
+        stats->triangleTestHistogram[min(stats->numTriangleTests - numTriangleTests, (S32)RayStats::NumHistogramBins - 1)]++;
+    }
+#endif
+}
+
 // void BVH::trace(RayBuffer& rays, RayStats* stats) const
 // {
 //     for(inti=0;i<rays.getSize();i++)
@@ -71,32 +338,26 @@ static Set<int> uniqueTreelets;
 //         Ray ray = rays.getRayForSlot(i);    // takes a local copy
 //         RayResult& result = rays.getMutableResultForSlot(i);
 // 
-//         result.clear();
-// 
-//         currentTreelet = -2;
 //         uniqueTreelets.clear();
-// 
-//         if(stats)
-//         {
-//             stats->platform = m_platform;
-//             stats->numRays++;
-//         }
-// 
-//         traceRecursive(m_root, ray,result,rays.getNeedClosestHit(), stats);
+//         trace(ray, result, rays.getNeedClosestHit(), stats);
 //     }
 // }
 
-void BVH::traceRecursive(BVHNode* node, Ray& ray, RayResult& result,bool needClosestHit, RayStats* stats) const
+void BVH::traceRecursive(BVHNode* node, Ray& ray, PrecomputedRay& setup, RayResult& result,bool needClosestHit, bool watertight, S32& currentTreelet, RayStats* stats) const
 {
-    if(currentTreelet != node->m_treelet)
+#if FW_RAY_STATS
+    if(stats)
     {
-        if(stats)
+        if(currentTreelet != node->m_treelet)
         {
 //          if(!uniqueTreelets.contains(node->m_treelet))   // count unique treelets (comment this line to count all)
                 stats->numTreelets++;
+            currentTreelet = node->m_treelet;
         }
-        currentTreelet = node->m_treelet;
+        if(node->m_treelet >= 0 && node->m_treelet < stats->treeletAccesses.getSize())
+            stats->treeletAccesses[node->m_treelet]++;
     }
+#endif
 
     if(node->isLeaf())
     {
@@ -104,8 +365,10 @@ void BVH::traceRecursive(BVHNode* node, Ray& ray, RayResult& result,bool needClo
         const Vec3i* triVtxIndex = (const Vec3i*)m_scene->getTriVtxIndexBufferPtr();
         const Vec3f* vtxPos = (const Vec3f*)m_scene->getVtxPosBufferPtr();
 
+#if FW_RAY_STATS
         if(stats)
             stats->numTriangleTests += m_platform.roundToTriangleBatchSize( leaf->getNumTriangles() );
+#endif
 
         for(int i=leaf->m_lo; i<leaf->m_hi; i++)
         {
@@ -114,14 +377,17 @@ void BVH::traceRecursive(BVHNode* node, Ray& ray, RayResult& result,bool needClo
             const Vec3f& v0 = vtxPos[ind.x];
             const Vec3f& v1 = vtxPos[ind.y];
             const Vec3f& v2 = vtxPos[ind.z];
-            Vec3f bary = Intersect::RayTriangle(v0,v1,v2, ray);
+            Vec3f bary = (watertight) ? Intersect::RayTriangleWatertight(v0,v1,v2, ray, setup) : Intersect::RayTriangle(v0,v1,v2, ray);
             float t = bary[2];
 
             if(t>ray.tmin && t<ray.tmax)
             {
                 ray.tmax    = t;
+                setup.tmax  = t;
                 result.t    = t;
                 result.id   = index;
+                result.u    = bary[0];
+                result.v    = bary[1];
 
                 if(!needClosestHit)
                     return;
@@ -130,34 +396,41 @@ void BVH::traceRecursive(BVHNode* node, Ray& ray, RayResult& result,bool needClo
     }
     else
     {
+#if FW_RAY_STATS
         if(stats)
             stats->numNodeTests += m_platform.roundToNodeBatchSize( node->getNumChildNodes() );
+#endif
 
-        const int TMIN = 0;
-        const int TMAX = 1;
         const InnerNode* inner = reinterpret_cast<const InnerNode*>(node);
-        BVHNode* child0 = inner->m_children[0];
-        BVHNode* child1 = inner->m_children[1];
-        Vec2f tspan0 = Intersect::RayBox(child0->m_bounds, ray);
-        Vec2f tspan1 = Intersect::RayBox(child1->m_bounds, ray);
-        bool intersect0 = (tspan0[TMIN]<=tspan0[TMAX]) && (tspan0[TMAX]>=ray.tmin) && (tspan0[TMIN]<=ray.tmax);
-        bool intersect1 = (tspan1[TMIN]<=tspan1[TMAX]) && (tspan1[TMAX]>=ray.tmin) && (tspan1[TMIN]<=ray.tmax);
 
+        // Closest hit => near child first. Child 0 is on the lower side of the split axis,
+        // so the direction sign decides. Occlusion rays keep the stored order.
+
+        bool flip = needClosestHit && inner->m_splitAxis >= 0 && setup.sign[inner->m_splitAxis];
+        BVHNode* child0 = inner->m_children[flip ? 1 : 0];
+        BVHNode* child1 = inner->m_children[flip ? 0 : 1];
+
+        // Both boxes in one slab test, clipped to the current ray interval.
+
+        const AABB* boxes[2] = { &child0->m_bounds, &child1->m_bounds };
+        F32 tnear[2];
+        U32 hits = Intersect::RayBoxes(boxes, 2, setup, tnear);
+        bool intersect0 = (hits & 1) != 0;
+        bool intersect1 = (hits & 2) != 0;
+
+        if(needClosestHit && inner->m_splitAxis < 0)    // unknown axis => order by entry distance
         if(intersect0 && intersect1)
-        if(tspan0[TMIN] > tspan1[TMIN])
-        {
-            swap(tspan0,tspan1);
+        if(tnear[0] > tnear[1])
             swap(child0,child1);
-        }
 
         if(intersect0)
-            traceRecursive(child0,ray,result,needClosestHit,stats);
+            traceRecursive(child0,ray,setup,result,needClosestHit,watertight,currentTreelet,stats);
 
         if(result.hit() && !needClosestHit)
             return;
 
-//      if(tspan1[TMIN] <= ray.tmax)    // this test helps only about 1-2%
+//      if(tnear[1] <= ray.tmax)    // this test helps only about 1-2%
         if(intersect1)
-            traceRecursive(child1,ray,result,needClosestHit,stats);
+            traceRecursive(child1,ray,setup,result,needClosestHit,watertight,currentTreelet,stats);
     }
 }
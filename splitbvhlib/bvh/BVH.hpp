@@ -33,27 +33,75 @@
 namespace FW
 {
 
+class ProgressiveBVHBuilder;
+class BVHBuildContext;
+
+// Traversal instrumentation. Building with FW_RAY_STATS 0 removes it from
+// BVH::trace() entirely; the RayStats argument is then ignored.
+
+#ifndef FW_RAY_STATS
+#   define FW_RAY_STATS 1
+#endif
+
+// Not synchronized: give each thread its own RayStats and add() them up
+// at the end of the batch.
+
 struct RayStats
 {
+    enum
+    {
+        NumHistogramBins = 257, // tests per ray; more go to the last bin
+    };
+
     RayStats()          { clear(); }
-    void clear()        { memset(this,0,sizeof(RayStats)); }
+    void clear()        { numRays = numTriangleTests = numNodeTests = numTreelets = 0; memset(nodeTestHistogram,0,sizeof(nodeTestHistogram)); memset(triangleTestHistogram,0,sizeof(triangleTestHistogram)); treeletAccesses.clear(); }
+    void add(const RayStats& other);
     void print() const  { if(numRays>0) printf("Ray stats: (%s) %d rays, %.1f tris/ray, %.1f nodes/ray (cost=%.2f) %.2f treelets/ray\n", platform.getName().getPtr(), numRays, 1.f*numTriangleTests/numRays, 1.f*numNodeTests/numRays, (platform.getSAHTriangleCost()*numTriangleTests/numRays + platform.getSAHNodeCost()*numNodeTests/numRays), 1.f*numTreelets/numRays ); }
 
     S32         numRays;
     S32         numTriangleTests;
     S32         numNodeTests;
     S32         numTreelets;
+    S32         nodeTestHistogram[NumHistogramBins];        // rays per number of node tests
+    S32         triangleTestHistogram[NumHistogramBins];    // rays per number of triangle tests
+    Array<S32>  treeletAccesses;    // nodes visited per treelet, see BVH::assignTreelets()
     Platform    platform;           // set by whoever sets the stats
 };
 
+inline void RayStats::add(const RayStats& other)
+{
+    if(!numRays)
+        platform = other.platform;
+    numRays             += other.numRays;
+    numTriangleTests    += other.numTriangleTests;
+    numNodeTests        += other.numNodeTests;
+    numTreelets         += other.numTreelets;
+    for(int i=0;i<NumHistogramBins;i++)
+    {
+        nodeTestHistogram[i]     += other.nodeTestHistogram[i];
+        triangleTestHistogram[i] += other.triangleTestHistogram[i];
+    }
+    for(int i=treeletAccesses.getSize();i<other.treeletAccesses.getSize();i++)
+        treeletAccesses.add(0);
+    for(int i=0;i<other.treeletAccesses.getSize();i++)
+        treeletAccesses[i] += other.treeletAccesses[i];
+}
+
 class BVH
 {
 public:
     struct Stats
     {
+        enum
+        {
+            NumDepthBins    = 65,   // deeper leaves go to the last bin
+            NumLeafSizeBins = 33,   // larger leaves go to the last bin
+        };
+
         Stats()             { clear(); }
         void clear()        { memset(this, 0, sizeof(Stats)); }
-        void print() const  { printf("Tree stats: [bfactor=%d] %d nodes (%d+%d), %.2f SAHCost, %.1f children/inner, %.1f tris/leaf\n", branchingFactor,numLeafNodes+numInnerNodes, numLeafNodes,numInnerNodes, SAHCost, 1.f*numChildNodes/max(numInnerNodes,1), 1.f*numTris/max(numLeafNodes,1)); }
+        void print() const  { printf("Tree stats: [bfactor=%d] %d nodes (%d+%d), %.2f SAHCost, %.1f children/inner, %.1f tris/leaf\n", branchingFactor,numLeafNodes+numInnerNodes, numLeafNodes,numInnerNodes, SAHCost, 1.f*numChildNodes/max(numInnerNodes,1), 1.f*numTris/max(numLeafNodes,1));
+                              printf("            %.2f EPO, %.3f overlap ratio, depth %d\n", EPO, overlapRatio, maxDepth); }
 
         F32     SAHCost;
         S32     branchingFactor;
@@ -61,47 +109,125 @@ public:
         S32     numLeafNodes;
         S32     numChildNodes;
         S32     numTris;
+
+        S32     maxDepth;
+        F32     EPO;            // end-point overlap: cost of nodes overlapping triangles outside their subtree, per unit triangle area
+        F32     overlapRatio;   // area shared by sibling boxes / area of their parents
+        F32     duplicateRatio; // leaf references per referenced triangle, minus one
+        S32     depthHistogram[NumDepthBins];           // leaves per depth, root = 0
+        S32     leafSizeHistogram[NumLeafSizeBins];     // leaves per triangle count
+        F32     sahByDepth[NumDepthBins];               // SAHCost of the nodes at each depth
+        F32     overlapByDepth[NumDepthBins];           // overlapRatio of the inner nodes at each depth
     };
 
     struct BuildParams
     {
+        typedef void (*ProgressFunc)(void* data, F32 progress, F32 duplicates); // Percentages.
+
         Stats*      stats;
         bool        enablePrints;
         F32         splitAlpha;     // spatial split area threshold
+        F32         duplicateBudget; // spatial split references allowed on top of the triangles, as a fraction of the triangle count
+        bool        progressive;    // build a coarse tree first and refine its leaves in the background
+        F32         deadline;       // progressive: seconds after which refinement stops, <= 0 for none
+        bool        deterministic;  // progressive: same tree and triangle indices for any thread count and timing; ignores the deadline
+        ProgressFunc progressFunc;  // called from the builder a few times per second, may be NULL
+        void*       progressData;
+        const volatile bool* cancel; // once *cancel is true, the rest of the tree is built out of leaves, also in the coarse tree of a progressive build; refinement ignores it, see stopRefinement()
+        const Ray*  sampleRays;     // weight split costs by hits of these rays; must stay valid while the BVH is being built or refined
+        S32         numSampleRays;
+        F32         rayWeight;      // with sample rays: 0 = surface area only, 1 = ray hits only
+        F32         earlySplit;     // > 0: instead of spatial splits, split triangle boxes larger than this fraction of the scene area up front, then build with binned SAH
+        S32         spatialBins;    // spatial split bins per axis, 8 to 256
+        bool        adaptiveBins;   // scale the spatial bins with the number of references in the node, up to spatialBins; off by default, as it changes the tree of existing builds
 
         BuildParams(void)
         {
             stats           = NULL;
             enablePrints    = false;
             splitAlpha      = 1.0e-5f;
+            duplicateBudget = 0.3f;
+            progressive     = false;
+            deadline        = 0.0f;
+            deterministic   = false;
+            progressFunc    = NULL;
+            progressData    = NULL;
+            cancel          = NULL;
+            sampleRays      = NULL;
+            numSampleRays   = 0;
+            rayWeight       = 0.9f;
+            earlySplit      = 0.0f;
+            spatialBins     = 128;
+            adaptiveBins    = false;
         }
 
         U32 computeHash(void) const
         {
-            return hashBits(floatToBits(splitAlpha));
+            return hashBits(
+                hashBits(floatToBits(splitAlpha), floatToBits(duplicateBudget), (progressive && !deterministic) ? floatToBits(deadline) : 0, (U32)progressive, floatToBits(earlySplit), (U32)deterministic),
+                (sampleRays) ? hashBuffer(sampleRays, numSampleRays * (int)sizeof(Ray)) : 0,
+                (sampleRays) ? floatToBits(rayWeight) : 0,
+                (U32)spatialBins,
+                (U32)adaptiveBins);
         }
     };
 
+    // Scene buffers in leaf order, see reorderToLeafOrder().
+
+    struct LeafOrderedScene
+    {
+        Array<Vec3i>    triVtxIndex;    // leaf order first, then triangles not referenced by any leaf
+        Array<Vec3f>    vtxPos;         // order of first use, unreferenced vertices removed
+        Array<S32>      triPermutation; // new triangle index => original triangle index
+        Array<S32>      vtxPermutation; // new vertex index => original vertex index
+    };
+
 public:
-	BVH(SceneBVH* scene, const Platform& platform, const BuildParams& params);
-	~BVH(void) { if (m_root) m_root->deleteSubtree(); if (m_scene) delete m_scene; }
+	BVH(SceneBVH* scene, const Platform& platform, const BuildParams& params, BVHBuildContext* context = NULL); // See BVHBuildContext. No context for progressive or early split builds.
+	~BVH(void);
 
 	SceneBVH*     getScene(void)			const { return m_scene; }
     const Platform&     getPlatform             (void) const            { return m_platform; }
     BVHNode*            getRoot                 (void) const            { return m_root; }
     //void                trace                   (RayBuffer& rays, RayStats* stats = NULL) const;
+    void                trace                   (Ray& ray, RayResult& result, bool needClosestHit, RayStats* stats = NULL, bool watertight = false) const; // Thread-safe, given one RayStats per thread. watertight: no rays slip between triangles sharing an edge.
+
+    // Groups the nodes into treelets, connected subtrees of at most
+    // maxNodes nodes, filled breadth first from the root down. RayStats
+    // then counts treelet switches and accesses. Returns the number of
+    // treelets. Leaves swapped in by progressive refinement have none.
+
+    S32                 assignTreelets          (S32 maxNodes);
+    S32                 getNumTreelets          (void) const            { return m_numTreelets; }
 
     Array<S32>&         getTriIndices           (void)                  { return m_triIndices; }
     const Array<S32>&   getTriIndices           (void) const            { return m_triIndices; }
 
+    // Rewrites the triangles and vertices in the order the leaves reference
+    // them, and switches the BVH over to the new buffers. The original
+    // buffers are not modified; 'out' must stay alive as long as the BVH.
+
+    void                reorderToLeafOrder      (LeafOrderedScene& out);
+
+    // Progressive builds. The tree is valid for traversal at all times.
+
+    bool                isRefining              (void) const;
+    bool                waitForRefinement       (void);     // Blocks until done or the deadline expires. Returns true if fully refined.
+    void                stopRefinement          (void);     // Keeps the current tree.
+
 private:
-    void                traceRecursive          (BVHNode* node, Ray& ray, RayResult& result, bool needClosestHit, RayStats* stats) const;
+    friend class BVHBuildContext;
+
+    void                traceRecursive          (BVHNode* node, Ray& ray, PrecomputedRay& setup, RayResult& result, bool needClosestHit, bool watertight, S32& currentTreelet, RayStats* stats) const;
 
     SceneBVH*             m_scene;
     Platform            m_platform;
 
     BVHNode*            m_root;
     Array<S32>          m_triIndices;
+    BVHNodeArena        m_nodeArena;    // Nodes of a build with a BVHBuildContext, otherwise empty.
+    S32                 m_numTreelets;
+    ProgressiveBVHBuilder* m_refiner;
 };
 
 }
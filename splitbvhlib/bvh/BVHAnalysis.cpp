@@ -0,0 +1,177 @@
+#include "BVHAnalysis.hpp"
+#include "SampleRays.hpp"
+#include "TreeStats.hpp"
+#include "base/MulticoreLauncher.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+namespace
+{
+
+enum { RayChunkSize = 4096 };
+
+struct RayTaskData
+{
+    const BVH*          bvh;
+    Vec3f               center;
+    F32                 radius;
+    S32                 numRays;
+    U32                 seed;
+    Array<RayStats>     stats;          // Per task.
+    Array<S32>          hits;           // Per task.
+};
+
+//------------------------------------------------------------------------
+// Rays are a function of their index only, so the result does not depend
+// on how they are split between the cores.
+
+inline F32 getRandom(U32 seed, S32 rayIdx, int dim)
+{
+    return (F32)(hashBits(seed, (U32)rayIdx, (U32)dim) >> 8) * (1.0f / (F32)(1 << 24));
+}
+
+inline Vec3f getPointOnSphere(U32 seed, S32 rayIdx, int dim)
+{
+    F32 z = getRandom(seed, rayIdx, dim) * 2.0f - 1.0f;
+    F32 phi = getRandom(seed, rayIdx, dim + 1) * 2.0f * FW_PI;
+    F32 r = FW::sqrt(max(1.0f - z * z, 0.0f));
+    return Vec3f(r * FW::cos(phi), r * FW::sin(phi), z);
+}
+
+//------------------------------------------------------------------------
+
+void rayTask(MulticoreLauncher::Task& task)
+{
+    RayTaskData& data = *(RayTaskData*)task.data;
+    const AABB& bounds = data.bvh->getRoot()->m_bounds;
+    RayStats& stats = data.stats[task.idx];
+    S32 hits = 0;
+
+    int end = min((task.idx + 1) * RayChunkSize, data.numRays);
+    for (int i = task.idx * RayChunkSize; i < end; i++)
+    {
+        // The line through two uniform points on a sphere is an isotropic
+        // uniform random line.
+
+        Vec3f p0 = data.center + getPointOnSphere(data.seed, i, 0) * data.radius;
+        Vec3f p1 = data.center + getPointOnSphere(data.seed, i, 2) * data.radius;
+
+        Ray ray;
+        ray.origin      = p0;
+        ray.direction   = p1 - p0;
+        ray.tmin        = 0.0f;
+        ray.tmax        = 1.0f;
+        if (!rayHitsBox(ray, bounds))
+            continue;
+
+        RayResult result;
+        data.bvh->trace(ray, result, true, &stats);
+        hits += (result.hit()) ? 1 : 0;
+    }
+
+    data.hits[task.idx] = hits;
+}
+
+//------------------------------------------------------------------------
+
+void appendHistogram(String& out, const S32* bins, int numBins)
+{
+    while (numBins && !bins[numBins - 1])
+        numBins--;
+    for (int i = 0; i < numBins; i++)
+        out.appendf("%s%d", (i) ? ", " : " ", bins[i]);
+}
+
+}
+
+//------------------------------------------------------------------------
+
+void FW::analyzeBVH(const BVH& bvh, BVHAnalysis& analysis, S32 numRays, U32 seed)
+{
+    computeTreeStats(bvh, analysis.stats);
+
+    const AABB& bounds = bvh.getRoot()->m_bounds;
+    RayTaskData data;
+    data.bvh        = &bvh;
+    data.center     = bounds.midPoint();
+    data.radius     = (bounds.valid()) ? (bounds.max() - bounds.min()).length() * 0.5f : 0.0f;
+    data.numRays    = numRays;
+    data.seed       = seed;
+
+    int numTasks = (numRays + RayChunkSize - 1) / RayChunkSize;
+    data.stats.reset(numTasks);
+    data.hits.reset(numTasks);
+    MulticoreLauncher().push(rayTask, &data, 0, numTasks).popAll();
+
+    RayStats& total = analysis.rayStats;
+    total.clear();
+    total.platform = bvh.getPlatform();
+    analysis.numRays = numRays;
+    analysis.numHits = 0;
+
+    for (int i = 0; i < numTasks; i++)
+    {
+        total.add(data.stats[i]);
+        analysis.numHits += data.hits[i];
+    }
+}
+
+//------------------------------------------------------------------------
+
+String FW::getAnalysisReport(const BVHAnalysis& analysis)
+{
+    const BVH::Stats& s = analysis.stats;
+    const RayStats& r = analysis.rayStats;
+    const Platform& p = r.platform;
+    F32 perRay = 1.0f / (F32)max(r.numRays, 1);
+
+    String name;
+    for (int i = 0; i < p.getName().getLength(); i++)
+    {
+        char c = p.getName().getChar(i);
+        if (c == '"' || c == '\\')
+            name.append('\\');
+        name.append(c);
+    }
+
+    String out;
+    out.appendf("{\n");
+    out.appendf("  \"platform\": { \"name\": \"%s\", \"nodeCost\": %g, \"triangleCost\": %g, \"nodeBatchSize\": %d, \"triangleBatchSize\": %d },\n",
+        name.getPtr(), p.getSAHNodeCost(), p.getSAHTriangleCost(), p.getNodeBatchSize(), p.getTriangleBatchSize());
+    out.appendf("  \"tree\": { \"innerNodes\": %d, \"leafNodes\": %d, \"triangleReferences\": %d, \"maxDepth\": %d, \"sah\": %g, \"epo\": %g, \"overlapRatio\": %g, \"duplicateRatio\": %g },\n",
+        s.numInnerNodes, s.numLeafNodes, s.numTris, s.maxDepth, s.SAHCost, s.EPO, s.overlapRatio, s.duplicateRatio);
+
+    int numDepths = min(s.maxDepth + 1, (S32)BVH::Stats::NumDepthBins);
+    out.appendf("  \"depths\": [\n");
+    for (int i = 0; i < numDepths; i++)
+        out.appendf("    { \"depth\": %d, \"leaves\": %d, \"sah\": %g, \"overlapRatio\": %g }%s\n",
+            i, s.depthHistogram[i], s.sahByDepth[i], s.overlapByDepth[i], (i + 1 < numDepths) ? "," : "");
+    out.appendf("  ],\n");
+
+    out.appendf("  \"leafSizes\": [");
+    for (int i = 0; i < BVH::Stats::NumLeafSizeBins; i++)
+        out.appendf("%s%d", (i) ? ", " : " ", s.leafSizeHistogram[i]);
+    out.appendf(" ],\n");
+
+    out.appendf("  \"rays\": { \"generated\": %d, \"traced\": %d, \"hits\": %d, \"nodeTestsPerRay\": %g, \"triangleTestsPerRay\": %g, \"costPerRay\": %g, \"treeletsPerRay\": %g },\n",
+        analysis.numRays, r.numRays, analysis.numHits, (F32)r.numNodeTests * perRay, (F32)r.numTriangleTests * perRay,
+        (p.getSAHNodeCost() * (F32)r.numNodeTests + p.getSAHTriangleCost() * (F32)r.numTriangleTests) * perRay, (F32)r.numTreelets * perRay);
+
+    // Histograms up to the last non-empty bin.
+
+    out.appendf("  \"nodeTestsPerRay\": [");
+    appendHistogram(out, r.nodeTestHistogram, RayStats::NumHistogramBins);
+    out.appendf(" ],\n");
+    out.appendf("  \"triangleTestsPerRay\": [");
+    appendHistogram(out, r.triangleTestHistogram, RayStats::NumHistogramBins);
+    out.appendf(" ],\n");
+    out.appendf("  \"treeletAccesses\": [");
+    appendHistogram(out, r.treeletAccesses.getPtr(), r.treeletAccesses.getSize());
+    out.appendf(" ]\n");
+    out.appendf("}\n");
+    return out;
+}
+
+//------------------------------------------------------------------------
@@ -0,0 +1,32 @@
+#pragma once
+#include "BVH.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Quality report for comparing builders and build parameters on the same
+// scene. The tree metrics come from computeTreeStats(). Traversal cost is
+// measured on random lines through the bounding sphere of the scene;
+// they hit a box with probability proportional to its surface area,
+// which is the distribution the SAH assumes.
+//
+// Stop or wait for the refinement of a progressive build first, or the
+// numbers describe whichever leaves were in place during the walks.
+// Call BVH::assignTreelets() first to get the treelet heatmap.
+//------------------------------------------------------------------------
+
+struct BVHAnalysis
+{
+    BVHAnalysis(void)   : numRays(0), numHits(0) {}
+
+    BVH::Stats          stats;
+    RayStats            rayStats;       // Rays that hit the scene bounds, closest hit.
+    S32                 numRays;        // Rays generated, including those missing the scene bounds.
+    S32                 numHits;        // Rays that hit a triangle.
+};
+
+void            analyzeBVH              (const BVH& bvh, BVHAnalysis& analysis, S32 numRays = 1 << 20, U32 seed = 0); // Also sets the node probabilities from surface areas.
+String          getAnalysisReport       (const BVHAnalysis& analysis);  // JSON.
+
+//------------------------------------------------------------------------
+}
@@ -0,0 +1,29 @@
+#include "BVHBuildContext.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+void BVHBuildContext::recycle(BVH* bvh)
+{
+    if (!bvh)
+        return;
+
+    // Nodes in an arena are freed with it, not one by one.
+
+    bvh->stopRefinement();
+    if (!bvh->m_nodeArena.isEmpty())
+        bvh->m_root = NULL;
+    bvh->m_nodeArena.clear();
+    bvh->m_triIndices.clear();
+
+    // Keep the larger buffers, i.e. the high-water mark of the builds.
+
+    if (bvh->m_nodeArena.getCapacity() > m_nodeArena.getCapacity())
+        m_nodeArena.swap(bvh->m_nodeArena);
+    if (bvh->m_triIndices.getCapacity() > m_triIndices.getCapacity())
+        m_triIndices.swap(bvh->m_triIndices);
+    delete bvh;
+}
+
+//------------------------------------------------------------------------
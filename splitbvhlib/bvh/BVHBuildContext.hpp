@@ -0,0 +1,48 @@
+#pragma once
+#include "SplitBVHBuilder.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Builder buffers kept between builds. Passing the same context to a
+// series of BVH constructors reuses the allocations of the previous
+// builds; the buffers grow to the largest build and are never shrunk.
+//
+// recycle() also takes back the nodes and triangle indices of a BVH
+// built with the context, so that a rebuild loop reaches a state where
+// the builder does not allocate at all:
+//
+//   BVH* bvh = new BVH(&scene, platform, params, &context);
+//   ...
+//   BVH* next = new BVH(&nextScene, platform, params, &context);
+//   context.recycle(bvh);
+//   bvh = next;
+//
+// A context may only be used by one build at a time, and only by SBVH
+// builds: progressive and early split builds do not take one.
+//------------------------------------------------------------------------
+
+class BVHBuildContext
+{
+public:
+                            BVHBuildContext     (void)          {}
+                            ~BVHBuildContext    (void)          {}
+
+    SplitBVHBuilder::Scratch& getSplitScratch   (void)          { return m_splitScratch; }
+    Array<S32>&             getTriIndices       (void)          { return m_triIndices; }
+    BVHNodeArena&           getNodeArena        (void)          { return m_nodeArena; }
+
+    void                    recycle             (BVH* bvh);     // Deletes the BVH and keeps its buffers if they are larger than the current ones.
+
+private:
+                            BVHBuildContext     (const BVHBuildContext&); // forbidden
+    BVHBuildContext&        operator=           (const BVHBuildContext&); // forbidden
+
+private:
+    SplitBVHBuilder::Scratch m_splitScratch;
+    Array<S32>              m_triIndices;           // Capacity only, lent to the next BVH.
+    BVHNodeArena            m_nodeArena;            // Ditto.
+};
+
+//------------------------------------------------------------------------
+}
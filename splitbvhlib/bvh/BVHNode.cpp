@@ -136,4 +136,45 @@ void BVHNode::assignIndicesBreadthFirst( S32 index, bool includeLeafNodes )
 }
 
 
+BVHNodeArena::~BVHNodeArena()
+{
+    for(int i=0;i<m_chunks.getSize();i++)
+        delete[] m_chunks[i];
+}
+
+
+S64 BVHNodeArena::getCapacity() const
+{
+    S64 bytes = 0;
+    for(int i=0;i<m_chunks.getSize();i++)
+        bytes += getChunkBytes(i);
+    return bytes;
+}
+
+
+void BVHNodeArena::swap(BVHNodeArena& other)
+{
+    m_chunks.swap(other.m_chunks);
+    FW::swap(m_chunk, other.m_chunk);
+    FW::swap(m_used, other.m_used);
+}
+
+
+void* BVHNodeArena::alloc(S32 bytes)
+{
+    bytes = (bytes + 15) & ~15;
+    if (m_chunks.getSize() && m_used + bytes > getChunkBytes(m_chunk))
+    {
+        m_chunk++;
+        m_used = 0;
+    }
+    if (m_chunk == m_chunks.getSize())
+        m_chunks.add(new U8[getChunkBytes(m_chunk)]);
+
+    void* ptr = m_chunks[m_chunk] + m_used;
+    m_used += bytes;
+    return ptr;
+}
+
+
 } //
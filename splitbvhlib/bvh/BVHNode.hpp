@@ -29,6 +29,7 @@
 #include "base/Array.hpp"
 #include "Platform.hpp"
 #include "Util.hpp"
+#include <new>
 
 namespace FW
 {
@@ -78,13 +79,14 @@ public:
 class InnerNode : public BVHNode
 {
 public:
-    InnerNode(const AABB& bounds,BVHNode* child0,BVHNode* child1)   { m_bounds=bounds; m_children[0]=child0; m_children[1]=child1; }
+    InnerNode(const AABB& bounds,BVHNode* child0,BVHNode* child1,int splitAxis=-1)  { m_bounds=bounds; m_children[0]=child0; m_children[1]=child1; m_splitAxis=splitAxis; }
 
     bool        isLeaf() const                  { return false; }
     S32         getNumChildNodes() const        { return 2; }
     BVHNode*    getChildNode(S32 i) const       { FW_ASSERT(i>=0 && i<2); return m_children[i]; }
 
     BVHNode*    m_children[2];
+    S32         m_splitAxis;    // child 0 is on the lower side along this axis, -1 if unknown
 };
 
 
@@ -103,4 +105,41 @@ public:
     S32         m_hi;
 };
 
+
+// Node storage that is freed, or rewound for reuse, as a whole.
+// Nodes allocated here must not be freed with deleteSubtree().
+
+class BVHNodeArena
+{
+private:
+    enum
+    {
+        MinChunkBytes   = 4 << 10,  // chunks double in size up to MaxChunkBytes
+        MaxChunkBytes   = 1 << 20,
+    };
+
+public:
+    BVHNodeArena() : m_chunk(0), m_used(0) {}
+    ~BVHNodeArena();
+
+    InnerNode*  newInner(const AABB& bounds,BVHNode* child0,BVHNode* child1,int splitAxis=-1)  { return new(alloc(sizeof(InnerNode))) InnerNode(bounds,child0,child1,splitAxis); }
+    LeafNode*   newLeaf(const AABB& bounds,int lo,int hi)                       { return new(alloc(sizeof(LeafNode))) LeafNode(bounds,lo,hi); }
+
+    bool        isEmpty() const                 { return m_chunk==0 && m_used==0; }
+    S64         getCapacity() const;            // bytes allocated
+    void        clear()                         { m_chunk=0; m_used=0; }    // forgets the nodes but keeps the memory
+    void        swap(BVHNodeArena& other);
+
+private:
+    BVHNodeArena(const BVHNodeArena&); // forbidden
+    BVHNodeArena& operator=(const BVHNodeArena&); // forbidden
+
+    static S32  getChunkBytes(S32 chunk)        { return (chunk < 8) ? MinChunkBytes << chunk : MaxChunkBytes; }
+    void*       alloc(S32 bytes);
+
+    Array<U8*>  m_chunks;
+    S32         m_chunk;    // current chunk
+    S32         m_used;     // bytes used in the current chunk
+};
+
 } //
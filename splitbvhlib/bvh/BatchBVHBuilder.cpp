@@ -0,0 +1,184 @@
+#include "BatchBVHBuilder.hpp"
+#include "BVHBuildContext.hpp"
+#include "TreeStats.hpp"
+#include "base/Sort.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+BatchBVHBuilder::BatchBVHBuilder(const Platform& platform, const BVH::BuildParams& params)
+:   m_platform      (platform),
+    m_params        (params),
+    m_userStats     (params.stats),
+    m_meshes        (NULL)
+{
+    m_params.stats = NULL;
+    m_params.enablePrints = false;
+    m_params.progressFunc = NULL;
+    m_params.progressive = false; // A refiner per mesh would compete with the other meshes for the cores.
+}
+
+//------------------------------------------------------------------------
+
+BatchBVHBuilder::~BatchBVHBuilder(void)
+{
+    clear();
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::run(const Mesh* meshes, int numMeshes)
+{
+    FW_ASSERT(meshes || !numMeshes);
+    clear();
+
+    m_meshes = meshes;
+    m_bvhs.reset(numMeshes);
+    m_stats.reset(numMeshes);
+    for (int i = 0; i < numMeshes; i++)
+    {
+        m_bvhs[i] = NULL;
+        m_stats[i].clear();
+    }
+
+    // Start with the largest meshes, so that the small ones fill the gaps
+    // at the end instead of one large mesh finishing last on its own.
+
+    m_order.reset(numMeshes);
+    for (int i = 0; i < numMeshes; i++)
+        m_order[i] = i;
+    sort(this, 0, numMeshes, sizeCompare, sizeSwap);
+
+    MulticoreLauncher().push(buildTask, this, 0, numMeshes).popAll();
+    m_meshes = NULL;
+
+    aggregateStats();
+    if (m_userStats)
+        *m_userStats = m_totalStats;
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::buildMesh(int idx)
+{
+    // The worker thread keeps its context until it exits, so the buffers
+    // are also reused across calls to run().
+
+    Thread* thread = Thread::getCurrent();
+    BVHBuildContext* context = (BVHBuildContext*)thread->getUserData("BatchBVHBuilder");
+    if (!context)
+    {
+        context = new BVHBuildContext;
+        thread->setUserData("BatchBVHBuilder", context, deinitContext);
+    }
+
+    const Mesh& mesh = m_meshes[idx];
+    SceneBVH scene(mesh.triVtxIndex, mesh.vtxPos, mesh.numTriangles, mesh.numVertices);
+    BVH* bvh = new BVH(&scene, m_platform, m_params, context);
+
+    // Already on a worker thread => collect the stats serially.
+
+    if (m_userStats)
+        computeTreeStats(*bvh, m_stats[idx], false);
+    m_bvhs[idx] = bvh;
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::clear(void)
+{
+    for (int i = 0; i < m_bvhs.getSize(); i++)
+        delete m_bvhs[i];
+    m_bvhs.reset();
+    m_stats.reset();
+    m_order.reset();
+    m_totalStats.clear();
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::aggregateStats(void)
+{
+    // Sums in mesh order, so the result does not depend on the scheduling.
+    // Ratios are weighted by the number of triangles in each tree.
+
+    BVH::Stats& total = m_totalStats;
+    total.clear();
+    total.branchingFactor = 2;
+    if (!m_userStats)
+        return;
+
+    F64 weightSum = 0.0;
+    F64 epo = 0.0, overlapRatio = 0.0, duplicateRatio = 0.0;
+    F64 overlapByDepth[BVH::Stats::NumDepthBins] = {};
+
+    for (int i = 0; i < m_stats.getSize(); i++)
+    {
+        const BVH::Stats& s = m_stats[i];
+        total.SAHCost       += s.SAHCost;
+        total.numInnerNodes += s.numInnerNodes;
+        total.numLeafNodes  += s.numLeafNodes;
+        total.numChildNodes += s.numChildNodes;
+        total.numTris       += s.numTris;
+        total.maxDepth      = max(total.maxDepth, s.maxDepth);
+
+        for (int j = 0; j < BVH::Stats::NumDepthBins; j++)
+        {
+            total.depthHistogram[j] += s.depthHistogram[j];
+            total.sahByDepth[j]     += s.sahByDepth[j];
+        }
+        for (int j = 0; j < BVH::Stats::NumLeafSizeBins; j++)
+            total.leafSizeHistogram[j] += s.leafSizeHistogram[j];
+
+        F64 weight = (F64)s.numTris;
+        weightSum       += weight;
+        epo             += weight * s.EPO;
+        overlapRatio    += weight * s.overlapRatio;
+        duplicateRatio  += weight * s.duplicateRatio;
+        for (int j = 0; j < BVH::Stats::NumDepthBins; j++)
+            overlapByDepth[j] += weight * s.overlapByDepth[j];
+    }
+
+    if (weightSum > 0.0)
+    {
+        total.EPO               = (F32)(epo / weightSum);
+        total.overlapRatio      = (F32)(overlapRatio / weightSum);
+        total.duplicateRatio    = (F32)(duplicateRatio / weightSum);
+        for (int j = 0; j < BVH::Stats::NumDepthBins; j++)
+            total.overlapByDepth[j] = (F32)(overlapByDepth[j] / weightSum);
+    }
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::buildTask(MulticoreLauncher::Task& task)
+{
+    BatchBVHBuilder* batch = (BatchBVHBuilder*)task.data;
+    batch->buildMesh(batch->m_order[task.idx]);
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::deinitContext(void* data)
+{
+    delete (BVHBuildContext*)data;
+}
+
+//------------------------------------------------------------------------
+
+bool BatchBVHBuilder::sizeCompare(void* data, int idxA, int idxB)
+{
+    const BatchBVHBuilder* batch = (const BatchBVHBuilder*)data;
+    return (batch->m_meshes[batch->m_order[idxA]].numTriangles > batch->m_meshes[batch->m_order[idxB]].numTriangles);
+}
+
+//------------------------------------------------------------------------
+
+void BatchBVHBuilder::sizeSwap(void* data, int idxA, int idxB)
+{
+    BatchBVHBuilder* batch = (BatchBVHBuilder*)data;
+    swap(batch->m_order[idxA], batch->m_order[idxB]);
+}
+
+//------------------------------------------------------------------------
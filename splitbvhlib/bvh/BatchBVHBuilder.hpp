@@ -0,0 +1,72 @@
+#pragma once
+#include "BVH.hpp"
+#include "base/MulticoreLauncher.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Builds a BVH for each of many small meshes, one mesh per task on the
+// MulticoreLauncher worker threads. Each worker keeps a BVHBuildContext,
+// so the builder buffers are reused from one mesh to the next:
+//
+//   BatchBVHBuilder batch(platform, params);
+//   batch.run(meshes, numMeshes);
+//   for (int i = 0; i < numMeshes; i++)
+//       bvhs[i] = batch.takeBVH(i);
+//
+// Prints, progress callbacks and progressive builds are disabled. With
+// params.stats set, each tree gets its stats and params.stats receives
+// the aggregate.
+//------------------------------------------------------------------------
+
+class BatchBVHBuilder
+{
+public:
+    struct Mesh
+    {
+        Vec3i*              triVtxIndex;
+        Vec3f*              vtxPos;
+        S32                 numTriangles;
+        S32                 numVertices;
+    };
+
+public:
+                            BatchBVHBuilder     (const Platform& platform, const BVH::BuildParams& params);
+                            ~BatchBVHBuilder    (void);         // Frees the BVHs that have not been taken.
+
+    void                    run                 (const Mesh* meshes, int numMeshes); // Blocks until all BVHs are built. The mesh buffers must stay alive as long as the BVHs.
+
+    int                     getNumBVHs          (void) const    { return m_bvhs.getSize(); }
+    BVH*                    getBVH              (int idx) const { return m_bvhs[idx]; }
+    BVH*                    takeBVH             (int idx)       { BVH* bvh = m_bvhs[idx]; m_bvhs[idx] = NULL; return bvh; } // The caller takes ownership.
+    const BVH::Stats&       getStats            (int idx) const { return m_stats[idx]; }
+    const BVH::Stats&       getStats            (void) const    { return m_totalStats; }
+
+private:
+    void                    buildMesh           (int idx);
+    void                    clear               (void);
+    void                    aggregateStats      (void);
+
+    static void             buildTask           (MulticoreLauncher::Task& task);
+    static void             deinitContext       (void* data);
+    static bool             sizeCompare         (void* data, int idxA, int idxB);
+    static void             sizeSwap            (void* data, int idxA, int idxB);
+
+private:
+                            BatchBVHBuilder     (const BatchBVHBuilder&); // forbidden
+    BatchBVHBuilder&        operator=           (const BatchBVHBuilder&); // forbidden
+
+private:
+    Platform                m_platform;
+    BVH::BuildParams        m_params;
+    BVH::Stats*             m_userStats;
+
+    const Mesh*             m_meshes;
+    Array<S32>              m_order;                // Mesh indices, largest first.
+    Array<BVH*>             m_bvhs;
+    Array<BVH::Stats>       m_stats;
+    BVH::Stats              m_totalStats;
+};
+
+//------------------------------------------------------------------------
+}
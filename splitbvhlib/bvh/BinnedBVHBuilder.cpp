@@ -0,0 +1,315 @@
+#include "BinnedBVHBuilder.hpp"
+#include "SplitBVHBuilder.hpp"
+#include "base/BinaryHeap.hpp"
+#include "base/Timer.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+BinnedBVHBuilder::BinnedBVHBuilder(BVH& bvh, const BVH::BuildParams& params, S32 leafSize)
+:   m_bvh           (bvh),
+    m_platform      (bvh.getPlatform()),
+    m_params        (params),
+    m_leafSize      (max(leafSize, m_platform.getMinLeafSize())),
+    m_numTris       (0),
+    m_numLeafRefs   (0)
+{
+}
+
+//------------------------------------------------------------------------
+
+BinnedBVHBuilder::~BinnedBVHBuilder(void)
+{
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* BinnedBVHBuilder::run(void)
+{
+    // Initialize references and determine root bounds.
+    // Degenerate triangles are dropped, as in SplitBVHBuilder.
+
+    const Vec3i* tris = (const Vec3i*)m_bvh.getScene()->getTriVtxIndexBufferPtr();
+    const Vec3f* verts = (const Vec3f*)m_bvh.getScene()->getVtxPosBufferPtr();
+    int numTris = m_bvh.getScene()->getNumTriangles();
+
+    AABB rootBounds;
+    AABB centroidBounds;
+    m_refs.clear();
+    m_refs.reserve(numTris);
+
+    for (int i = 0; i < numTris; i++)
+    {
+        Reference ref;
+        ref.triIdx = i;
+        for (int j = 0; j < 3; j++)
+            ref.bounds.grow(verts[tris[i][j]]);
+
+        Vec3f size = ref.bounds.max() - ref.bounds.min();
+        if (min(size) < 0.0f || sum(size) == max(size))
+            continue;
+
+        ref.centroid = ref.bounds.midPoint();
+        rootBounds.grow(ref.bounds);
+        m_refs.add(ref);
+    }
+
+    m_numTris = m_refs.getSize();
+    if (m_params.earlySplit > 0.0f)
+    {
+        performEarlySplits(rootBounds);
+        m_leafStamps.reset(numTris);
+        memset(m_leafStamps.getPtr(), -1, m_leafStamps.getNumBytes());
+    }
+
+    for (int i = 0; i < m_refs.getSize(); i++)
+        centroidBounds.grow(m_refs[i].centroid);
+
+    // Build recursively.
+
+    Timer timer(true);
+    m_numLeafRefs = 0;
+    m_progressTimer.start();
+    BVHNode* root = buildNode(0, m_refs.getSize(), rootBounds, centroidBounds, 0);
+    m_bvh.getTriIndices().compact();
+
+    // Done.
+
+    if (m_params.progressFunc)
+        reportProgress(100.0f);
+    m_refs.reset();
+    m_leafStamps.reset();
+
+    if (m_params.enablePrints)
+        printf("BinnedBVHBuilder: %d tris, %.2f ms\n", numTris, timer.getElapsed() * 1.0e3f);
+    return root;
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* BinnedBVHBuilder::buildNode(int start, int end, const AABB& bounds, const AABB& centroidBounds, int level)
+{
+    // Report progress.
+
+    if (m_params.progressFunc && m_progressTimer.getElapsed() >= 0.1f)
+    {
+        reportProgress((F32)m_numLeafRefs / (F32)m_refs.getSize() * 100.0f);
+        m_progressTimer.start();
+    }
+
+    int numRef = end - start;
+    if (numRef <= m_leafSize || level >= MaxDepth)
+        return createLeaf(start, end, bounds);
+
+    // Cancelled => finish quickly with whatever is left as a leaf.
+
+    if (m_params.cancel && *m_params.cancel)
+        return createLeaf(start, end, bounds);
+
+    // Bin references by centroid along each axis.
+
+    Vec3f origin = centroidBounds.min();
+    Vec3f extent = centroidBounds.max() - origin;
+    Vec3f scale;
+
+    for (int dim = 0; dim < 3; dim++)
+    {
+        scale[dim] = (extent[dim] > 0.0f) ? (F32)NumBins / extent[dim] : 0.0f;
+        for (int i = 0; i < NumBins; i++)
+        {
+            m_bins[dim][i].bounds = AABB();
+            m_bins[dim][i].count = 0;
+        }
+    }
+
+    for (int i = start; i < end; i++)
+    {
+        const Reference& ref = m_refs[i];
+        for (int dim = 0; dim < 3; dim++)
+        {
+            Bin& bin = m_bins[dim][clamp((int)((ref.centroid[dim] - origin[dim]) * scale[dim]), 0, NumBins - 1)];
+            bin.bounds.grow(ref.bounds);
+            bin.count++;
+        }
+    }
+
+    // Select the bin boundary with the lowest SAH.
+
+    F32 area = bounds.area();
+    F32 leafSAH = area * m_platform.getTriangleCost(numRef);
+    F32 nodeSAH = area * m_platform.getNodeCost(2);
+    F32 bestSAH = FW_F32_MAX;
+    int bestDim = -1;
+    int bestBin = 0;
+
+    for (int dim = 0; dim < 3; dim++)
+    {
+        if (scale[dim] == 0.0f)
+            continue;
+
+        // Empty bins are skipped; growing by an empty box would make it infinite.
+
+        AABB rightBounds;
+        for (int i = NumBins - 1; i > 0; i--)
+        {
+            if (m_bins[dim][i].count)
+                rightBounds.grow(m_bins[dim][i].bounds);
+            m_rightBounds[i] = rightBounds;
+        }
+
+        AABB leftBounds;
+        int leftCount = 0;
+        for (int i = 1; i < NumBins; i++)
+        {
+            if (m_bins[dim][i - 1].count)
+                leftBounds.grow(m_bins[dim][i - 1].bounds);
+            leftCount += m_bins[dim][i - 1].count;
+            int rightCount = numRef - leftCount;
+            if (leftCount == 0 || rightCount == 0)
+                continue;
+
+            F32 sah = nodeSAH +
+                leftBounds.area() * m_platform.getTriangleCost(leftCount) +
+                m_rightBounds[i].area() * m_platform.getTriangleCost(rightCount);
+
+            if (sah < bestSAH)
+            {
+                bestSAH = sah;
+                bestDim = dim;
+                bestBin = i;
+            }
+        }
+    }
+
+    // Leaf is cheaper, or centroids cannot be separated => create leaf.
+
+    if (numRef <= m_platform.getMaxLeafSize() && (bestDim == -1 || leafSAH <= bestSAH))
+        return createLeaf(start, end, bounds);
+
+    // Partition references.
+    // All centroids coincide => split in the middle.
+
+    int mid = (start + end) >> 1;
+    if (bestDim != -1)
+    {
+        mid = start;
+        int right = end;
+        while (mid < right)
+        {
+            const Reference& ref = m_refs[mid];
+            if (clamp((int)((ref.centroid[bestDim] - origin[bestDim]) * scale[bestDim]), 0, NumBins - 1) < bestBin)
+                mid++;
+            else
+                swap(m_refs[mid], m_refs[--right]);
+        }
+    }
+
+    AABB leftBounds, leftCentroidBounds;
+    AABB rightBounds, rightCentroidBounds;
+
+    for (int i = start; i < mid; i++)
+    {
+        leftBounds.grow(m_refs[i].bounds);
+        leftCentroidBounds.grow(m_refs[i].centroid);
+    }
+    for (int i = mid; i < end; i++)
+    {
+        rightBounds.grow(m_refs[i].bounds);
+        rightCentroidBounds.grow(m_refs[i].centroid);
+    }
+
+    // Create inner node.
+
+    BVHNode* leftNode = buildNode(start, mid, leftBounds, leftCentroidBounds, level + 1);
+    BVHNode* rightNode = buildNode(mid, end, rightBounds, rightCentroidBounds, level + 1);
+    return new InnerNode(bounds, leftNode, rightNode, bestDim);
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* BinnedBVHBuilder::createLeaf(int start, int end, const AABB& bounds)
+{
+    // Pieces of the same triangle may end up in the same leaf => list it once.
+
+    Array<S32>& tris = m_bvh.getTriIndices();
+    int lo = tris.getSize();
+    m_numLeafRefs += end - start;
+    for (int i = start; i < end; i++)
+    {
+        S32 triIdx = m_refs[i].triIdx;
+        if (m_leafStamps.getSize())
+        {
+            if (m_leafStamps[triIdx] == lo)
+                continue;
+            m_leafStamps[triIdx] = lo;
+        }
+        tris.add(triIdx);
+    }
+    return new LeafNode(bounds, lo, tris.getSize());
+}
+
+//------------------------------------------------------------------------
+
+void BinnedBVHBuilder::reportProgress(F32 progress)
+{
+    // Duplicates come from early splits only.
+
+    F32 duplicates = (m_numTris) ? (F32)(m_refs.getSize() - m_numTris) / (F32)m_numTris * 100.0f : 0.0f;
+    m_params.progressFunc(m_params.progressData, progress, duplicates);
+}
+
+//------------------------------------------------------------------------
+
+void BinnedBVHBuilder::performEarlySplits(const AABB& rootBounds)
+{
+    // Split the largest boxes first, each in the middle of its longest axis,
+    // until all are below the threshold or the duplicate budget is spent.
+
+    const Vec3i* tris = (const Vec3i*)m_bvh.getScene()->getTriVtxIndexBufferPtr();
+    const Vec3f* verts = (const Vec3f*)m_bvh.getScene()->getVtxPosBufferPtr();
+    F32 threshold = rootBounds.area() * m_params.earlySplit;
+    int maxDuplicates = (int)((F32)m_refs.getSize() * max(m_params.duplicateBudget, 0.0f));
+
+    BinaryHeap<F32> largest;
+    for (int i = 0; i < m_refs.getSize(); i++)
+        if (m_refs[i].bounds.area() > threshold)
+            largest.add(i, -m_refs[i].bounds.area());
+
+    int numDuplicates = 0;
+    while (!largest.isEmpty() && numDuplicates < maxDuplicates)
+    {
+        int idx = largest.removeMinIndex();
+        Reference ref = m_refs[idx];
+        Vec3f size = ref.bounds.max() - ref.bounds.min();
+        int dim = (size.x >= size.y && size.x >= size.z) ? 0 : (size.y >= size.z) ? 1 : 2;
+
+        const Vec3i& inds = tris[ref.triIdx];
+        Vec3f triVerts[3] = { verts[inds.x], verts[inds.y], verts[inds.z] };
+        Reference pieces[2];
+        SplitBVHBuilder::splitTriangleBounds(pieces[0].bounds, pieces[1].bounds, triVerts, ref.bounds, dim, ref.bounds.midPoint()[dim]);
+
+        // The triangle only touches one side => keep the reference as it is.
+
+        if (!pieces[0].bounds.valid() || !pieces[1].bounds.valid())
+            continue;
+
+        for (int i = 0; i < 2; i++)
+        {
+            pieces[i].triIdx = ref.triIdx;
+            pieces[i].centroid = pieces[i].bounds.midPoint();
+
+            int pieceIdx = (i == 0) ? idx : m_refs.getSize();
+            if (i == 0)
+                m_refs[idx] = pieces[i];
+            else
+                m_refs.add(pieces[i]);
+
+            if (pieces[i].bounds.area() > threshold)
+                largest.add(pieceIdx, -pieces[i].bounds.area());
+        }
+        numDuplicates++;
+    }
+}
+
+//------------------------------------------------------------------------
@@ -0,0 +1,366 @@
+#include "DistanceQuery.hpp"
+#include "base/Sort.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+namespace
+{
+
+struct EdgeRef
+{
+    S32             v0;             // Smaller vertex index first.
+    S32             v1;
+    S32             triEdge;        // Triangle index * 3 + edge.
+};
+
+struct FillData
+{
+    const DistanceQuery* query;
+    F32*            grid;
+    Vec3f           origin;         // Center of the first voxel.
+    Vec3f           voxelSize;
+    Vec3i           resolution;
+    F32             maxDistance;
+};
+
+//------------------------------------------------------------------------
+
+bool edgeCompare(void* data, int idxA, int idxB)
+{
+    const EdgeRef& a = ((const EdgeRef*)data)[idxA];
+    const EdgeRef& b = ((const EdgeRef*)data)[idxB];
+    return (a.v0 < b.v0 || (a.v0 == b.v0 && a.v1 < b.v1));
+}
+
+void edgeSwap(void* data, int idxA, int idxB)
+{
+    EdgeRef* edges = (EdgeRef*)data;
+    swap(edges[idxA], edges[idxB]);
+}
+
+//------------------------------------------------------------------------
+
+Vec3f safeNormalize(const Vec3f& v)
+{
+    F32 len = v.length();
+    return (len > 0.0f) ? v * (1.0f / len) : Vec3f(0.0f);
+}
+
+F32 getAngle(const Vec3f& a, const Vec3f& b)
+{
+    F32 len = a.length() * b.length();
+    return (len > 0.0f) ? FW::acos(clamp(dot(a, b) / len, -1.0f, 1.0f)) : 0.0f;
+}
+
+}
+
+//------------------------------------------------------------------------
+
+DistanceQuery::DistanceQuery(const BVH& bvh)
+:   m_bvh   (bvh),
+    m_tris  (bvh.getScene()->getTriVtxIndexBufferPtr()),
+    m_verts (bvh.getScene()->getVtxPosBufferPtr())
+{
+    int numTris = bvh.getScene()->getNumTriangles();
+    int numVerts = bvh.getScene()->getNumVertices();
+
+    // Face normals, and vertex normals weighted by the angle at each corner.
+
+    m_faceNormals.reset(numTris);
+    m_vertexNormals.reset(numVerts);
+    for (int i = 0; i < numVerts; i++)
+        m_vertexNormals[i] = Vec3f(0.0f);
+
+    for (int i = 0; i < numTris; i++)
+    {
+        const Vec3i& tri = m_tris[i];
+        Vec3f normal = safeNormalize(cross(m_verts[tri.y] - m_verts[tri.x], m_verts[tri.z] - m_verts[tri.x]));
+        m_faceNormals[i] = normal;
+
+        for (int j = 0; j < 3; j++)
+        {
+            const Vec3f& v = m_verts[tri[j]];
+            F32 angle = getAngle(m_verts[tri[(j + 1) % 3]] - v, m_verts[tri[(j + 2) % 3]] - v);
+            m_vertexNormals[tri[j]] += normal * angle;
+        }
+    }
+
+    // Edge normals: sort the edges by their vertices, so that the triangles
+    // sharing an edge are adjacent, and sum their face normals.
+
+    Array<EdgeRef> edges;
+    edges.reset(numTris * 3);
+    for (int i = 0; i < numTris; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            EdgeRef& edge = edges[i * 3 + j];
+            edge.v0 = min(m_tris[i][j], m_tris[i][(j + 1) % 3]);
+            edge.v1 = max(m_tris[i][j], m_tris[i][(j + 1) % 3]);
+            edge.triEdge = i * 3 + j;
+        }
+    }
+    sort(edges.getPtr(), 0, edges.getSize(), edgeCompare, edgeSwap, true);
+
+    m_edgeNormals.reset(numTris * 3);
+    for (int start = 0; start < edges.getSize();)
+    {
+        int end = start + 1;
+        while (end < edges.getSize() && edges[end].v0 == edges[start].v0 && edges[end].v1 == edges[start].v1)
+            end++;
+
+        Vec3f normal(0.0f);
+        for (int i = start; i < end; i++)
+            normal += m_faceNormals[edges[i].triEdge / 3];
+        for (int i = start; i < end; i++)
+            m_edgeNormals[edges[i].triEdge] = normal;
+        start = end;
+    }
+}
+
+//------------------------------------------------------------------------
+
+DistanceQuery::~DistanceQuery(void)
+{
+}
+
+//------------------------------------------------------------------------
+
+F32 DistanceQuery::getSignedDistance(const Vec3f& point, Result* result, F32 maxDistance) const
+{
+    Closest closest;
+    closest.distSqr = (maxDistance < FW::sqrt(FW_F32_MAX)) ? sqr(maxDistance) : FW_F32_MAX;
+    closest.point   = point;
+    closest.triIdx  = -1;
+    closest.feature = Feature_Face;
+    findClosest(m_bvh.getRoot(), point, closest);
+
+    // Nothing within range => the sign is unknown, report outside.
+
+    F32 distance = maxDistance;
+    if (closest.triIdx != -1)
+    {
+        distance = FW::sqrt(closest.distSqr);
+        if (dot(point - closest.point, getPseudoNormal(closest.triIdx, closest.feature)) < 0.0f)
+            distance = -distance;
+    }
+
+    if (result)
+    {
+        result->distance        = distance;
+        result->closestPoint    = closest.point;
+        result->triIdx          = closest.triIdx;
+    }
+    return distance;
+}
+
+//------------------------------------------------------------------------
+
+void DistanceQuery::fillGrid(Array<F32>& grid, const AABB& bounds, const Vec3i& resolution, F32 maxDistance) const
+{
+    FW_ASSERT(resolution.min() >= 0);
+    grid.reset(resolution.x * resolution.y * resolution.z);
+    if (!grid.getSize())
+        return;
+
+    FillData data;
+    data.query          = this;
+    data.grid           = grid.getPtr();
+    data.voxelSize      = (bounds.max() - bounds.min()) / Vec3f(resolution);
+    data.origin         = bounds.min() + data.voxelSize * 0.5f;
+    data.resolution     = resolution;
+    data.maxDistance    = maxDistance;
+    MulticoreLauncher().push(fillTask, &data, 0, resolution.z).popAll();
+}
+
+//------------------------------------------------------------------------
+
+void DistanceQuery::findClosest(const BVHNode* node, const Vec3f& point, Closest& closest) const
+{
+    if (node->isLeaf())
+    {
+        const LeafNode* leaf = (const LeafNode*)node;
+        const Array<S32>& triIndices = m_bvh.getTriIndices();
+        for (int i = leaf->m_lo; i < leaf->m_hi; i++)
+        {
+            S32 triIdx = triIndices[i];
+            const Vec3i& tri = m_tris[triIdx];
+            Feature feature;
+            Vec3f p = getClosestPointOnTriangle(point, m_verts[tri.x], m_verts[tri.y], m_verts[tri.z], feature);
+            F32 distSqr = (p - point).lenSqr();
+            if (distSqr < closest.distSqr)
+            {
+                closest.distSqr = distSqr;
+                closest.point   = p;
+                closest.triIdx  = triIdx;
+                closest.feature = feature;
+            }
+        }
+        return;
+    }
+
+    // Nearer child first; it may rule out the other one.
+
+    const BVHNode* child0 = node->getChildNode(0);
+    const BVHNode* child1 = node->getChildNode(1);
+    F32 dist0 = getBoxDistSqr(child0->m_bounds, point);
+    F32 dist1 = getBoxDistSqr(child1->m_bounds, point);
+    if (dist1 < dist0)
+    {
+        swap(child0, child1);
+        swap(dist0, dist1);
+    }
+
+    if (dist0 < closest.distSqr)
+        findClosest(child0, point, closest);
+    if (dist1 < closest.distSqr)
+        findClosest(child1, point, closest);
+}
+
+//------------------------------------------------------------------------
+
+Vec3f DistanceQuery::getPseudoNormal(S32 triIdx, Feature feature) const
+{
+    switch (feature)
+    {
+    case Feature_Vertex0:   return m_vertexNormals[m_tris[triIdx].x];
+    case Feature_Vertex1:   return m_vertexNormals[m_tris[triIdx].y];
+    case Feature_Vertex2:   return m_vertexNormals[m_tris[triIdx].z];
+    case Feature_Edge01:    return m_edgeNormals[triIdx * 3 + 0];
+    case Feature_Edge12:    return m_edgeNormals[triIdx * 3 + 1];
+    case Feature_Edge20:    return m_edgeNormals[triIdx * 3 + 2];
+    default:                return m_faceNormals[triIdx];
+    }
+}
+
+//------------------------------------------------------------------------
+// Real-Time Collision Detection (Ericson 2005), section 5.1.5, extended
+// to report which feature of the triangle the point is closest to.
+
+Vec3f DistanceQuery::getClosestPointOnTriangle(const Vec3f& p, const Vec3f& a, const Vec3f& b, const Vec3f& c, Feature& feature)
+{
+    Vec3f ab = b - a;
+    Vec3f ac = c - a;
+    Vec3f ap = p - a;
+    F32 d1 = dot(ab, ap);
+    F32 d2 = dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+    {
+        feature = Feature_Vertex0;
+        return a;
+    }
+
+    Vec3f bp = p - b;
+    F32 d3 = dot(ab, bp);
+    F32 d4 = dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+    {
+        feature = Feature_Vertex1;
+        return b;
+    }
+
+    F32 vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f && d1 > d3) // d1 - d3 = |ab|^2, zero for a collapsed edge.
+    {
+        feature = Feature_Edge01;
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    Vec3f cp = p - c;
+    F32 d5 = dot(ab, cp);
+    F32 d6 = dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+    {
+        feature = Feature_Vertex2;
+        return c;
+    }
+
+    F32 vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f && d2 > d6)
+    {
+        feature = Feature_Edge20;
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    F32 va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f && (d4 - d3) + (d5 - d6) > 0.0f)
+    {
+        feature = Feature_Edge12;
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    // Degenerate or sliver triangle => no interior to speak of, and the
+    // barycentrics are mostly rounding error. The closest point is on one
+    // of the edges. denom is |ab x ac|^2, compared to |ab|^2 |ac|^2.
+
+    F32 denom = va + vb + vc;
+    if (denom <= 1.0e-6f * ab.lenSqr() * ac.lenSqr())
+    {
+        Feature edgeFeatures[3];
+        Vec3f edgePoints[3] =
+        {
+            getClosestPointOnEdge(p, a, b, Feature_Vertex0, Feature_Edge01, Feature_Vertex1, edgeFeatures[0]),
+            getClosestPointOnEdge(p, b, c, Feature_Vertex1, Feature_Edge12, Feature_Vertex2, edgeFeatures[1]),
+            getClosestPointOnEdge(p, c, a, Feature_Vertex2, Feature_Edge20, Feature_Vertex0, edgeFeatures[2]),
+        };
+
+        int best = 0;
+        for (int i = 1; i < 3; i++)
+            if ((edgePoints[i] - p).lenSqr() < (edgePoints[best] - p).lenSqr())
+                best = i;
+
+        feature = edgeFeatures[best];
+        return edgePoints[best];
+    }
+
+    feature = Feature_Face;
+    return a + ab * (vb / denom) + ac * (vc / denom);
+}
+
+//------------------------------------------------------------------------
+
+Vec3f DistanceQuery::getClosestPointOnEdge(const Vec3f& p, const Vec3f& a, const Vec3f& b, Feature vertexA, Feature edge, Feature vertexB, Feature& feature)
+{
+    Vec3f ab = b - a;
+    F32 t = dot(p - a, ab);
+    if (t <= 0.0f)
+    {
+        feature = vertexA;
+        return a;
+    }
+
+    F32 lenSqr = ab.lenSqr();
+    if (t >= lenSqr)
+    {
+        feature = vertexB;
+        return b;
+    }
+
+    feature = edge;
+    return a + ab * (t / lenSqr);
+}
+
+//------------------------------------------------------------------------
+
+F32 DistanceQuery::getBoxDistSqr(const AABB& box, const Vec3f& point)
+{
+    Vec3f d = max(max(box.min() - point, point - box.max()), Vec3f(0.0f));
+    return d.lenSqr();
+}
+
+//------------------------------------------------------------------------
+
+void DistanceQuery::fillTask(MulticoreLauncher::Task& task)
+{
+    const FillData& data = *(const FillData*)task.data;
+    const Vec3i& res = data.resolution;
+    F32* slice = data.grid + task.idx * res.x * res.y;
+
+    for (int y = 0; y < res.y; y++)
+        for (int x = 0; x < res.x; x++)
+            slice[y * res.x + x] = data.query->getSignedDistance(data.origin + data.voxelSize * Vec3f((F32)x, (F32)y, (F32)task.idx), NULL, data.maxDistance);
+}
+
+//------------------------------------------------------------------------
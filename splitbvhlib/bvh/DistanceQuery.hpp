@@ -0,0 +1,87 @@
+#pragma once
+#include "BVH.hpp"
+#include "base/MulticoreLauncher.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Closest-point and signed-distance queries against the triangles of a
+// BVH. The sign comes from the angle-weighted pseudo-normal of the
+// closest feature (Baerentzen & Aanaes 2005): the face normal for a point
+// closest to a face, the sum of the adjacent face normals for an edge,
+// and the angle-weighted sum around a vertex. The sign is exact for a
+// closed, consistently oriented mesh; elsewhere it follows the nearest
+// surface.
+//
+// The pseudo-normals are computed once in the constructor. The BVH and
+// its scene buffers must stay alive and unchanged while the query is in
+// use; wait for or stop the refinement of a progressive build first.
+// Queries are thread-safe.
+//------------------------------------------------------------------------
+
+class DistanceQuery
+{
+public:
+    struct Result
+    {
+        F32                 distance;       // Negative inside.
+        Vec3f               closestPoint;
+        S32                 triIdx;         // -1 if nothing is within maxDistance.
+    };
+
+public:
+    explicit                DistanceQuery       (const BVH& bvh);
+                            ~DistanceQuery      (void);
+
+    F32                     getSignedDistance   (const Vec3f& point, Result* result = NULL, F32 maxDistance = FW_F32_MAX) const; // maxDistance if nothing is closer; the sign is then unknown.
+    bool                    isInside            (const Vec3f& point) const  { return (getSignedDistance(point) < 0.0f); }
+
+    // Signed distances at the voxel centers of a resX x resY x resZ grid
+    // over the box, x fastest. Slices are filled in parallel. Voxels with
+    // nothing within maxDistance get maxDistance.
+
+    void                    fillGrid            (Array<F32>& grid, const AABB& bounds, const Vec3i& resolution, F32 maxDistance = FW_F32_MAX) const;
+
+private:
+    enum Feature
+    {
+        Feature_Face = 0,
+        Feature_Vertex0,    // Vertex i of the triangle.
+        Feature_Vertex1,
+        Feature_Vertex2,
+        Feature_Edge01,     // Edge from vertex i to vertex (i + 1) % 3.
+        Feature_Edge12,
+        Feature_Edge20,
+    };
+
+    struct Closest
+    {
+        F32                 distSqr;
+        Vec3f               point;
+        S32                 triIdx;
+        Feature             feature;
+    };
+
+    void                    findClosest         (const BVHNode* node, const Vec3f& point, Closest& closest) const;
+    Vec3f                   getPseudoNormal     (S32 triIdx, Feature feature) const;
+
+    static Vec3f            getClosestPointOnTriangle (const Vec3f& p, const Vec3f& a, const Vec3f& b, const Vec3f& c, Feature& feature);
+    static Vec3f            getClosestPointOnEdge (const Vec3f& p, const Vec3f& a, const Vec3f& b, Feature vertexA, Feature edge, Feature vertexB, Feature& feature);
+    static F32              getBoxDistSqr       (const AABB& box, const Vec3f& point);
+    static void             fillTask            (MulticoreLauncher::Task& task);
+
+private:
+                            DistanceQuery       (const DistanceQuery&); // forbidden
+    DistanceQuery&          operator=           (const DistanceQuery&); // forbidden
+
+private:
+    const BVH&              m_bvh;
+    const Vec3i*            m_tris;
+    const Vec3f*            m_verts;
+    Array<Vec3f>            m_faceNormals;      // Per triangle, unit length or zero.
+    Array<Vec3f>            m_edgeNormals;      // Three per triangle.
+    Array<Vec3f>            m_vertexNormals;    // Per vertex.
+};
+
+//------------------------------------------------------------------------
+}
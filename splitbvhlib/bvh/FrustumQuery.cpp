@@ -0,0 +1,192 @@
+#include "FrustumQuery.hpp"
+#include "base/Sort.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+FrustumQuery::FrustumQuery(const BVH& bvh)
+:   m_bvh   (bvh),
+    m_tris  (bvh.getScene()->getTriVtxIndexBufferPtr()),
+    m_verts (bvh.getScene()->getVtxPosBufferPtr())
+{
+}
+
+//------------------------------------------------------------------------
+
+FrustumQuery::~FrustumQuery(void)
+{
+}
+
+//------------------------------------------------------------------------
+
+void FrustumQuery::setPlanes(const Vec4f* planes, int numPlanes)
+{
+    FW_ASSERT(numPlanes >= 0 && numPlanes <= MaxPlanes);
+    FW_ASSERT(planes || !numPlanes);
+
+    m_planes.clear();
+    for (int i = 0; i < numPlanes; i++)
+        addPlane(Vec4d(planes[i]));
+}
+
+//------------------------------------------------------------------------
+// Fast Extraction of Viewing Frustum Planes from the World-View-Projection
+// Matrix (Gribb & Hartmann 2001).
+
+void FrustumQuery::setClipMatrix(const Mat4f& worldToClip)
+{
+    Mat4d m = worldToClip;
+    Vec4d r0 = m.getRow(0);
+    Vec4d r1 = m.getRow(1);
+    Vec4d r2 = m.getRow(2);
+    Vec4d r3 = m.getRow(3);
+
+    m_planes.clear();
+    addPlane(r3 + r0);
+    addPlane(r3 - r0);
+    addPlane(r3 + r1);
+    addPlane(r3 - r1);
+    addPlane(r3 + r2);
+    addPlane(r3 - r2);
+}
+
+//------------------------------------------------------------------------
+
+void FrustumQuery::setCameraMatrix(const Mat4d& worldToImage, int width, int height, F64 zNear, F64 zFar)
+{
+    FW_ASSERT(width > 0 && height > 0);
+    FW_ASSERT(zNear > 0.0 && zNear < zFar);
+
+    // 0 <= x / z <= width and 0 <= y / z <= height, multiplied through by z > 0.
+
+    Vec4d r0 = worldToImage.getRow(0);
+    Vec4d r1 = worldToImage.getRow(1);
+    Vec4d r2 = worldToImage.getRow(2);
+    Vec4d r3 = worldToImage.getRow(3);
+
+    m_planes.clear();
+    addPlane(r2 - r3 * zNear);
+    addPlane(r3 * zFar - r2);
+    addPlane(r0);
+    addPlane(r2 * (F64)width - r0);
+    addPlane(r1);
+    addPlane(r2 * (F64)height - r1);
+}
+
+//------------------------------------------------------------------------
+
+void FrustumQuery::getLeaves(Array<const LeafNode*>& leaves) const
+{
+    leaves.clear();
+    U32 mask = (m_planes.getSize() < 32) ? (1u << m_planes.getSize()) - 1 : ~0u;
+    cullNode(m_bvh.getRoot(), mask, leaves, NULL);
+}
+
+//------------------------------------------------------------------------
+
+void FrustumQuery::getTriangles(Array<S32>& triIndices) const
+{
+    Array<const LeafNode*> leaves;
+    Array<U32> leafMasks;
+    U32 mask = (m_planes.getSize() < 32) ? (1u << m_planes.getSize()) - 1 : ~0u;
+    cullNode(m_bvh.getRoot(), mask, leaves, &leafMasks);
+
+    const Array<S32>& bvhTriIndices = m_bvh.getTriIndices();
+    triIndices.clear();
+    for (int i = 0; i < leaves.getSize(); i++)
+    {
+        const LeafNode* leaf = leaves[i];
+        for (int j = leaf->m_lo; j < leaf->m_hi; j++)
+            if (!leafMasks[i] || !cullTriangle(bvhTriIndices[j], leafMasks[i]))
+                triIndices.add(bvhTriIndices[j]);
+    }
+
+    // Spatial splits reference a triangle from several leaves.
+
+    sort(triIndices);
+    int num = 0;
+    for (int i = 0; i < triIndices.getSize(); i++)
+        if (!num || triIndices[i] != triIndices[num - 1])
+            triIndices[num++] = triIndices[i];
+    triIndices.resize(num);
+}
+
+//------------------------------------------------------------------------
+
+void FrustumQuery::cullNode(const BVHNode* node, U32 mask, Array<const LeafNode*>& leaves, Array<U32>* leafMasks) const
+{
+    if (mask && cullBox(node->m_bounds, mask))
+        return;
+
+    if (node->isLeaf())
+    {
+        leaves.add((const LeafNode*)node);
+        if (leafMasks)
+            leafMasks->add(mask);
+        return;
+    }
+
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+        cullNode(node->getChildNode(i), mask, leaves, leafMasks);
+}
+
+//------------------------------------------------------------------------
+
+bool FrustumQuery::cullBox(const AABB& box, U32& mask) const
+{
+    const Vec3f& lo = box.min();
+    const Vec3f& hi = box.max();
+
+    for (int i = 0; i < m_planes.getSize(); i++)
+    {
+        if ((mask & (1u << i)) == 0)
+            continue;
+
+        // Corner furthest along the normal outside => the whole box is.
+        // Corner furthest against the normal inside => the whole box is.
+
+        const Vec4f& plane = m_planes[i];
+        Vec3f pos((plane.x >= 0.0f) ? hi.x : lo.x, (plane.y >= 0.0f) ? hi.y : lo.y, (plane.z >= 0.0f) ? hi.z : lo.z);
+        Vec3f neg((plane.x >= 0.0f) ? lo.x : hi.x, (plane.y >= 0.0f) ? lo.y : hi.y, (plane.z >= 0.0f) ? lo.z : hi.z);
+
+        if (dot(plane.getXYZ(), pos) + plane.w < 0.0f)
+            return true;
+        if (dot(plane.getXYZ(), neg) + plane.w >= 0.0f)
+            mask &= ~(1u << i);
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------
+
+bool FrustumQuery::cullTriangle(S32 triIdx, U32 mask) const
+{
+    const Vec3i& tri = m_tris[triIdx];
+    for (int i = 0; i < m_planes.getSize(); i++)
+    {
+        if ((mask & (1u << i)) == 0)
+            continue;
+
+        const Vec4f& plane = m_planes[i];
+        if (dot(plane.getXYZ(), m_verts[tri.x]) + plane.w < 0.0f &&
+            dot(plane.getXYZ(), m_verts[tri.y]) + plane.w < 0.0f &&
+            dot(plane.getXYZ(), m_verts[tri.z]) + plane.w < 0.0f)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------
+
+void FrustumQuery::addPlane(const Vec4d& plane)
+{
+    // Normalize in double precision; pixel-space rows are large.
+
+    F64 len = plane.getXYZ().length();
+    m_planes.add(Vec4f((len > 0.0) ? plane * (1.0 / len) : plane));
+}
+
+//------------------------------------------------------------------------
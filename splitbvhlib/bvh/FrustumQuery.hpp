@@ -0,0 +1,67 @@
+#pragma once
+#include "BVH.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Culls a BVH against a convex set of planes, typically a view frustum.
+// Each node is tested only against the planes its parent straddles; a
+// node entirely inside all of them is accepted with its whole subtree
+// without further tests.
+//
+// A point p is inside a plane when dot(plane.getXYZ(), p) + plane.w >= 0.
+// The BVH must stay alive and unchanged while the query is in use.
+// Queries are thread-safe once the planes are set.
+//------------------------------------------------------------------------
+
+class FrustumQuery
+{
+public:
+    enum
+    {
+        MaxPlanes = 32,     // Planes still to test are kept in a U32 mask.
+    };
+
+public:
+    explicit                FrustumQuery        (const BVH& bvh);
+                            ~FrustumQuery       (void);
+
+    void                    setPlanes           (const Vec4f* planes, int numPlanes);
+    void                    setClipMatrix       (const Mat4f& worldToClip);     // OpenGL clip space, -w <= x, y, z <= w.
+
+    // Pinhole camera matrix, as built by compute_camera_matrix_p(): pixel
+    // coordinates are (x / z, y / z) and z is the depth along the view axis.
+    // Column-major, so glm::value_ptr() of a dmat4x4 can go to Mat4d::fromPtr().
+
+    void                    setCameraMatrix     (const Mat4d& worldToImage, int width, int height, F64 zNear, F64 zFar);
+
+    int                     getNumPlanes        (void) const                { return m_planes.getSize(); }
+    const Vec4f&            getPlane            (int idx) const             { return m_planes[idx]; }
+
+    void                    getLeaves           (Array<const LeafNode*>& leaves) const; // Leaves whose boxes are not culled.
+
+    // Scene triangle indices, ascending and without duplicates. Triangles in
+    // leaves that straddle a plane are kept unless all three vertices are
+    // outside the same plane, so a few outside a frustum corner may remain.
+
+    void                    getTriangles        (Array<S32>& triIndices) const;
+
+private:
+    void                    cullNode            (const BVHNode* node, U32 mask, Array<const LeafNode*>& leaves, Array<U32>* leafMasks) const;
+    bool                    cullBox             (const AABB& box, U32& mask) const; // Also clears the planes the box is inside of.
+    bool                    cullTriangle        (S32 triIdx, U32 mask) const;
+    void                    addPlane            (const Vec4d& plane);
+
+private:
+                            FrustumQuery        (const FrustumQuery&); // forbidden
+    FrustumQuery&           operator=           (const FrustumQuery&); // forbidden
+
+private:
+    const BVH&              m_bvh;
+    const Vec3i*            m_tris;
+    const Vec3f*            m_verts;
+    Array<Vec4f>            m_planes;           // Normalized.
+};
+
+//------------------------------------------------------------------------
+}
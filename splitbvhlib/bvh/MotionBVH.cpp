@@ -0,0 +1,201 @@
+#include "MotionBVH.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+MotionBVH::MotionBVH(SceneBVH* scene0, SceneBVH* scene1, const Platform& platform, const BVH::BuildParams& params)
+{
+    FW_ASSERT(scene0 && scene1);
+    FW_ASSERT(scene0->getNumTriangles() == scene1->getNumTriangles());
+    FW_ASSERT(scene0->getNumVertices() == scene1->getNumVertices());
+
+    m_tris   = scene0->getTriVtxIndexBufferPtr();
+    m_verts0 = scene0->getVtxPosBufferPtr();
+    m_verts1 = scene1->getVtxPosBufferPtr();
+
+    // Build over the midpoint, where the interpolated boxes are tightest on average.
+
+    int numVerts = scene0->getNumVertices();
+    m_midVerts.reset(numVerts);
+    for (int i = 0; i < numVerts; i++)
+        m_midVerts[i] = (m_verts0[i] + m_verts1[i]) * 0.5f;
+
+    BVH::BuildParams buildParams = params;
+    buildParams.splitAlpha  = FW_F32_MAX;
+    buildParams.progressive = false;
+    buildParams.earlySplit  = 0.0f;
+
+    SceneBVH midScene(scene0->getTriVtxIndexBufferPtr(), m_midVerts.getPtr(), scene0->getNumTriangles(), numVerts);
+    m_bvh = new BVH(&midScene, platform, buildParams);
+
+    // Bounds at both keys, indexed by node.
+
+    BVHNode* root = m_bvh->getRoot();
+    root->assignIndicesDepthFirst();
+    m_bounds0.reset(root->getSubtreeSize(BVH_STAT_NODE_COUNT));
+    m_bounds1.reset(m_bounds0.getSize());
+    refit(root);
+}
+
+//------------------------------------------------------------------------
+
+MotionBVH::~MotionBVH(void)
+{
+    delete m_bvh;
+}
+
+//------------------------------------------------------------------------
+
+AABB MotionBVH::getBounds(const BVHNode* node, F32 time) const
+{
+    const AABB& b0 = m_bounds0[node->m_index];
+    const AABB& b1 = m_bounds1[node->m_index];
+    return AABB(lerp(b0.min(), b1.min(), time), lerp(b0.max(), b1.max(), time));
+}
+
+//------------------------------------------------------------------------
+
+void MotionBVH::trace(Ray& ray, F32 time, RayResult& result, bool needClosestHit, RayStats* stats) const
+{
+    result.clear();
+    time = clamp(time, 0.0f, 1.0f);
+
+#if FW_RAY_STATS
+    S32 numNodeTests = 0;
+    S32 numTriangleTests = 0;
+    if (stats)
+    {
+        if (!stats->numRays)
+            stats->platform = m_bvh->getPlatform();
+        stats->numRays++;
+        numNodeTests = stats->numNodeTests;
+        numTriangleTests = stats->numTriangleTests;
+    }
+#endif
+
+    // The root box is tested like any other, so a ray missing it does no more work.
+
+    PrecomputedRay setup(ray);
+    const BVHNode* root = m_bvh->getRoot();
+    AABB rootBounds = getBounds(root, time);
+    const AABB* boxes[1] = { &rootBounds };
+    if (Intersect::RayBoxes(boxes, 1, setup))
+        traceRecursive(root, ray, time, setup, result, needClosestHit, stats);
+
+#if FW_RAY_STATS
+    if (stats)
+    {
+        stats->nodeTestHistogram[min(stats->numNodeTests - numNodeTests, (S32)RayStats::NumHistogramBins - 1)]++;
+        stats->triangleTestHistogram[min(stats->numTriangleTests - numTriangleTests, (S32)RayStats::NumHistogramBins - 1)]++;
+    }
+#endif
+}
+
+//------------------------------------------------------------------------
+
+void MotionBVH::refit(const BVHNode* node)
+{
+    AABB& b0 = m_bounds0[node->m_index];
+    AABB& b1 = m_bounds1[node->m_index];
+    b0 = AABB();
+    b1 = AABB();
+
+    if (node->isLeaf())
+    {
+        const LeafNode* leaf = (const LeafNode*)node;
+        const Array<S32>& triIndices = m_bvh->getTriIndices();
+        for (int i = leaf->m_lo; i < leaf->m_hi; i++)
+        {
+            const Vec3i& tri = m_tris[triIndices[i]];
+            for (int j = 0; j < 3; j++)
+            {
+                b0.grow(m_verts0[tri[j]]);
+                b1.grow(m_verts1[tri[j]]);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+    {
+        const BVHNode* child = node->getChildNode(i);
+        refit(child);
+        b0.grow(m_bounds0[child->m_index]);
+        b1.grow(m_bounds1[child->m_index]);
+    }
+}
+
+//------------------------------------------------------------------------
+
+void MotionBVH::traceRecursive(const BVHNode* node, Ray& ray, F32 time, PrecomputedRay& setup, RayResult& result, bool needClosestHit, RayStats* stats) const
+{
+    if (node->isLeaf())
+    {
+        const LeafNode* leaf = (const LeafNode*)node;
+        const Array<S32>& triIndices = m_bvh->getTriIndices();
+
+#if FW_RAY_STATS
+        if (stats)
+            stats->numTriangleTests += m_bvh->getPlatform().roundToTriangleBatchSize(leaf->getNumTriangles());
+#endif
+
+        for (int i = leaf->m_lo; i < leaf->m_hi; i++)
+        {
+            int index = triIndices[i];
+            const Vec3i& tri = m_tris[index];
+            Vec3f v0 = lerp(m_verts0[tri.x], m_verts1[tri.x], time);
+            Vec3f v1 = lerp(m_verts0[tri.y], m_verts1[tri.y], time);
+            Vec3f v2 = lerp(m_verts0[tri.z], m_verts1[tri.z], time);
+            Vec3f bary = Intersect::RayTriangle(v0, v1, v2, ray);
+            F32 t = bary[2];
+
+            if (t > ray.tmin && t < ray.tmax)
+            {
+                ray.tmax    = t;
+                setup.tmax  = t;
+                result.t    = t;
+                result.id   = index;
+                result.u    = bary[0];
+                result.v    = bary[1];
+
+                if (!needClosestHit)
+                    return;
+            }
+        }
+        return;
+    }
+
+#if FW_RAY_STATS
+    if (stats)
+        stats->numNodeTests += m_bvh->getPlatform().roundToNodeBatchSize(node->getNumChildNodes());
+#endif
+
+    // Same child order as BVH::traceRecursive(); the split axis comes from the midpoint build.
+
+    const InnerNode* inner = (const InnerNode*)node;
+    bool flip = needClosestHit && inner->m_splitAxis >= 0 && setup.sign[inner->m_splitAxis];
+    const BVHNode* child0 = inner->m_children[flip ? 1 : 0];
+    const BVHNode* child1 = inner->m_children[flip ? 0 : 1];
+
+    AABB bounds[2] = { getBounds(child0, time), getBounds(child1, time) };
+    const AABB* boxes[2] = { &bounds[0], &bounds[1] };
+    F32 tnear[2];
+    U32 hits = Intersect::RayBoxes(boxes, 2, setup, tnear);
+    bool intersect0 = (hits & 1) != 0;
+    bool intersect1 = (hits & 2) != 0;
+
+    if (needClosestHit && inner->m_splitAxis < 0 && intersect0 && intersect1 && tnear[0] > tnear[1])
+        swap(child0, child1);
+
+    if (intersect0)
+        traceRecursive(child0, ray, time, setup, result, needClosestHit, stats);
+
+    if (result.hit() && !needClosestHit)
+        return;
+
+    if (intersect1)
+        traceRecursive(child1, ray, time, setup, result, needClosestHit, stats);
+}
+
+//------------------------------------------------------------------------
@@ -0,0 +1,52 @@
+#pragma once
+#include "BVH.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// BVH over triangles that move linearly between two time keys, given as
+// two scenes with the same triangles and vertex count. The tree is built
+// once, over the vertices halfway between the keys, and each node stores
+// its bounds at both keys. A ray at time t intersects node bounds and
+// vertices interpolated to t; linear interpolation of the key bounds
+// always contains the interpolated triangles, so no hits are missed.
+//
+// Spatial splits clip references to one vertex snapshot, so they are
+// disabled, as are progressive and early-split builds. The scene buffers
+// must stay alive and unchanged as long as the MotionBVH.
+//------------------------------------------------------------------------
+
+class MotionBVH
+{
+public:
+                        MotionBVH           (SceneBVH* scene0, SceneBVH* scene1, const Platform& platform, const BVH::BuildParams& params);
+                        ~MotionBVH          (void);
+
+    const BVH&          getBVH              (void) const                { return *m_bvh; }  // Topology and midpoint bounds.
+    AABB                getBounds           (const BVHNode* node, F32 time) const;
+
+    // Time is clamped to [0, 1]: 0 = scene0, 1 = scene1. Thread-safe,
+    // given one RayStats per thread; treelets are not tracked.
+
+    void                trace               (Ray& ray, F32 time, RayResult& result, bool needClosestHit, RayStats* stats = NULL) const;
+
+private:
+    void                refit               (const BVHNode* node);
+    void                traceRecursive      (const BVHNode* node, Ray& ray, F32 time, PrecomputedRay& setup, RayResult& result, bool needClosestHit, RayStats* stats) const;
+
+private:
+                        MotionBVH           (const MotionBVH&); // forbidden
+    MotionBVH&          operator=           (const MotionBVH&); // forbidden
+
+private:
+    const Vec3i*        m_tris;
+    const Vec3f*        m_verts0;
+    const Vec3f*        m_verts1;
+    Array<Vec3f>        m_midVerts;
+    BVH*                m_bvh;
+    Array<AABB>         m_bounds0;          // Per BVHNode::m_index.
+    Array<AABB>         m_bounds1;
+};
+
+//------------------------------------------------------------------------
+}
@@ -0,0 +1,286 @@
+#include "ProgressiveBVHBuilder.hpp"
+#include "BinnedBVHBuilder.hpp"
+#include "SplitBVHBuilder.hpp"
+#include "base/Sort.hpp"
+#include "base/Timer.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+ProgressiveBVHBuilder::ProgressiveBVHBuilder(BVH& bvh, const BVH::BuildParams& params)
+:   m_bvh           (bvh),
+    m_params        (params),
+    m_coarseParams  (params),
+    m_startTicks    (Timer::queryTicks()),
+    m_numTriIndices (0),
+    m_numRefined    (0),
+    m_numPublished  (0),
+    m_stopped       (false)
+{
+    m_params.stats = NULL;
+    m_params.enablePrints = false;
+    m_params.progressFunc = NULL;
+    m_params.cancel = NULL; // Refinement outlives the caller's flag; use stop() instead.
+    m_params.earlySplit = 0.0f; // Leaves are refined from triangles, not from pieces of them.
+
+    m_coarseParams.stats = NULL;
+    m_coarseParams.earlySplit = 0.0f;
+}
+
+//------------------------------------------------------------------------
+
+ProgressiveBVHBuilder::~ProgressiveBVHBuilder(void)
+{
+    stop();
+    for (int i = 0; i < m_retired.getSize(); i++)
+        m_retired[i]->deleteSubtree();
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* ProgressiveBVHBuilder::run(void)
+{
+    // Aim for a few leaves per core, so that the worker threads stay busy
+    // even though the refinement times of the leaves vary.
+
+    int numTris = m_bvh.getScene()->getNumTriangles();
+    int numLeaves = (m_params.deterministic) ? NumDeterministicLeaves : MulticoreLauncher::getNumCores() * 8;
+    int leafSize = max(numTris / numLeaves, 64);
+    BVHNode* root = BinnedBVHBuilder(m_bvh, m_coarseParams, leafSize).run();
+
+    // Cancelled => keep the coarse tree, there is nothing to refine it for.
+
+    if (m_coarseParams.cancel && *m_coarseParams.cancel)
+        return root;
+
+    // Single leaf => not worth refining, build the final tree right away.
+
+    if (root->isLeaf())
+    {
+        root->deleteSubtree();
+        m_bvh.getTriIndices().reset();
+        return SplitBVHBuilder(m_bvh, m_coarseParams).run();
+    }
+
+    // Refine the leaves with the largest SAH contribution first.
+
+    InnerNode* inner = (InnerNode*)root;
+    m_leaves.clear();
+    collectLeaves(&inner->m_children[0]);
+    collectLeaves(&inner->m_children[1]);
+    sort(m_leaves.getPtr(), 0, m_leaves.getSize(), priorityCompare, prioritySwap);
+
+    // Reserve room for refining every leaf, including its duplicate budget.
+
+    Array<S32>& triIndices = m_bvh.getTriIndices();
+    m_numTriIndices = triIndices.getSize();
+    triIndices.resize(m_numTriIndices * 2 + (S32)((F32)m_numTriIndices * max(m_params.duplicateBudget, 0.0f)));
+    return root;
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::start(void)
+{
+    m_launcher.push(refineTask, this, 0, m_leaves.getSize());
+}
+
+//------------------------------------------------------------------------
+
+bool ProgressiveBVHBuilder::wait(void)
+{
+    if (m_params.deadline <= 0.0f || m_params.deterministic)
+        m_launcher.popAll();
+
+    while (m_launcher.getNumTasks())
+    {
+        if (m_launcher.getNumFinished())
+            m_launcher.pop();
+        else if (!isExpired())
+            Thread::sleep(1);
+        else
+        {
+            // Deadline expired => keep the current tree.
+            // The refinements in progress are discarded when they finish.
+
+            m_lock.enter();
+            m_stopped = true;
+            m_lock.leave();
+            return false;
+        }
+    }
+
+    finish();
+    return (m_numRefined == m_leaves.getSize());
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::stop(void)
+{
+    m_lock.enter();
+    m_stopped = true;
+    m_lock.leave();
+
+    m_launcher.popAll();
+    finish();
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::collectLeaves(BVHNode** slot)
+{
+    BVHNode* node = *slot;
+    if (!node->isLeaf())
+    {
+        InnerNode* inner = (InnerNode*)node;
+        collectLeaves(&inner->m_children[0]);
+        collectLeaves(&inner->m_children[1]);
+        return;
+    }
+
+    CoarseLeaf& coarse = m_leaves.add();
+    coarse.leaf = (LeafNode*)node;
+    coarse.slot = slot;
+    coarse.priority = node->getArea() * (F32)coarse.leaf->getNumTriangles();
+    coarse.refined = NULL;
+    coarse.done = false;
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::refineLeaf(int idx)
+{
+    CoarseLeaf& coarse = m_leaves[idx];
+    if (m_stopped || isExpired())
+        return;
+
+    // Build a full SBVH over the triangles of the leaf.
+    // The range of the leaf is never written while refinement is in progress.
+
+    Array<S32>& triIndices = m_bvh.getTriIndices();
+    Array<S32> triSubset(triIndices.getPtr(coarse.leaf->m_lo), coarse.leaf->getNumTriangles());
+    Array<S32> refined;
+    BVHNode* node = SplitBVHBuilder(m_bvh, m_params).run(triSubset.getPtr(), triSubset.getSize(), refined);
+
+    if (!m_params.deterministic)
+    {
+        m_lock.enter();
+        bool accept = publish(coarse, node, refined);
+        m_lock.leave();
+
+        if (!accept)
+            node->deleteSubtree();
+        return;
+    }
+
+    // Deterministic => park the subtree until the leaves before it are in.
+
+    m_lock.enter();
+    coarse.refined = node;
+    coarse.refinedIndices = refined;
+    coarse.done = true;
+
+    while (m_numPublished < m_leaves.getSize() && m_leaves[m_numPublished].done)
+    {
+        CoarseLeaf& next = m_leaves[m_numPublished++];
+        if (!publish(next, next.refined, next.refinedIndices))
+            next.refined->deleteSubtree();
+        next.refined = NULL;
+        next.refinedIndices.reset();
+    }
+    m_lock.leave();
+}
+
+//------------------------------------------------------------------------
+
+bool ProgressiveBVHBuilder::publish(const CoarseLeaf& coarse, BVHNode* node, const Array<S32>& refined)
+{
+    // Copy triangle indices to the reserved space and swap in the subtree.
+    // The exchange is a full memory barrier, so a traversal that sees the
+    // new subtree also sees its nodes and triangle indices.
+
+    Array<S32>& triIndices = m_bvh.getTriIndices();
+    if (m_stopped || isExpired() || m_numTriIndices + refined.getSize() > triIndices.getSize())
+        return false;
+
+    triIndices.setRange(m_numTriIndices, refined);
+    offsetLeaves(node, m_numTriIndices);
+    m_numTriIndices += refined.getSize();
+
+    InterlockedExchangePointer((PVOID*)coarse.slot, node);
+    m_retired.add(coarse.leaf);
+    m_numRefined++;
+    return true;
+}
+
+//------------------------------------------------------------------------
+
+bool ProgressiveBVHBuilder::isExpired(void) const
+{
+    return (m_params.deadline > 0.0f && !m_params.deterministic && Timer::ticksToSecs(Timer::queryTicks() - m_startTicks) >= m_params.deadline);
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::finish(void)
+{
+    // No refinements in progress => release the unused part of the reserve.
+    // Shrinking does not reallocate, so concurrent traversals are not affected.
+
+    FW_ASSERT(!m_launcher.getNumTasks());
+    if (m_leaves.getSize())
+        m_bvh.getTriIndices().resize(m_numTriIndices);
+
+    // Stopped => subtrees parked behind an unfinished leaf are not needed.
+
+    for (int i = m_numPublished; i < m_leaves.getSize(); i++)
+    {
+        if (m_leaves[i].refined)
+            m_leaves[i].refined->deleteSubtree();
+        m_leaves[i].refined = NULL;
+        m_leaves[i].refinedIndices.reset();
+    }
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::refineTask(MulticoreLauncher::Task& task)
+{
+    ((ProgressiveBVHBuilder*)task.data)->refineLeaf(task.idx);
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::offsetLeaves(BVHNode* node, S32 offset)
+{
+    if (node->isLeaf())
+    {
+        LeafNode* leaf = (LeafNode*)node;
+        leaf->m_lo += offset;
+        leaf->m_hi += offset;
+        return;
+    }
+
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+        offsetLeaves(node->getChildNode(i), offset);
+}
+
+//------------------------------------------------------------------------
+
+bool ProgressiveBVHBuilder::priorityCompare(void* data, int idxA, int idxB)
+{
+    const CoarseLeaf* leaves = (const CoarseLeaf*)data;
+    return (leaves[idxA].priority > leaves[idxB].priority);
+}
+
+//------------------------------------------------------------------------
+
+void ProgressiveBVHBuilder::prioritySwap(void* data, int idxA, int idxB)
+{
+    CoarseLeaf* leaves = (CoarseLeaf*)data;
+    swap(leaves[idxA], leaves[idxB]);
+}
+
+//------------------------------------------------------------------------
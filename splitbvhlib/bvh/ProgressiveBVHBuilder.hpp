@@ -0,0 +1,91 @@
+#pragma once
+#include "BVH.hpp"
+#include "base/MulticoreLauncher.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Builds a coarse large-leaf tree with BinnedBVHBuilder, and then replaces
+// its leaves with SplitBVHBuilder subtrees on the MulticoreLauncher worker
+// threads. Each refined subtree is published with a single pointer store,
+// so the tree stays valid for traversal at all times.
+//
+// Triangle indices of refined subtrees go to space reserved at the end of
+// BVH::getTriIndices() up front, so the array is never reallocated while
+// refinement is in progress. Replaced leaves are kept alive until the
+// builder is destroyed, since a concurrent traversal may still visit them.
+//
+// Deterministic builds size the coarse leaves independently of the core
+// count, and publish the refined subtrees in priority order, whichever
+// finishes first. The final tree and triangle indices are then the same
+// for any number of threads.
+//------------------------------------------------------------------------
+
+class ProgressiveBVHBuilder
+{
+private:
+    enum
+    {
+        NumDeterministicLeaves = 256,   // Coarse leaves to aim for in deterministic builds.
+    };
+
+    struct CoarseLeaf
+    {
+        LeafNode*           leaf;
+        BVHNode**           slot;       // Child pointer of the parent node that refers to the leaf.
+        F32                 priority;   // SAH contribution of the leaf; larger ones are refined first.
+
+        BVHNode*            refined;    // Deterministic builds: subtree waiting for the leaves before it.
+        Array<S32>          refinedIndices;
+        bool                done;
+    };
+
+public:
+                            ProgressiveBVHBuilder   (BVH& bvh, const BVH::BuildParams& params);
+                            ~ProgressiveBVHBuilder  (void);
+
+    BVHNode*                run                     (void);     // Returns the coarse tree.
+    void                    start                   (void);     // Starts refining the coarse tree in the background.
+
+    bool                    isFinished              (void) const    { return (m_launcher.getNumFinished() == m_launcher.getNumTasks()); }
+    bool                    wait                    (void);     // Blocks until done or the deadline expires. Returns true if all leaves were refined.
+    void                    stop                    (void);     // Freezes the tree, and waits for the refinements in progress to finish.
+
+    S32                     getNumLeaves            (void) const    { return m_leaves.getSize(); }
+    S32                     getNumRefined           (void) const    { return m_numRefined; }
+
+private:
+    void                    collectLeaves           (BVHNode** slot);
+    void                    refineLeaf              (int idx);
+    bool                    publish                 (const CoarseLeaf& coarse, BVHNode* node, const Array<S32>& triIndices);
+    bool                    isExpired               (void) const;
+    void                    finish                  (void);
+
+    static void             refineTask              (MulticoreLauncher::Task& task);
+    static void             offsetLeaves            (BVHNode* node, S32 offset);
+    static bool             priorityCompare         (void* data, int idxA, int idxB);
+    static void             prioritySwap            (void* data, int idxA, int idxB);
+
+private:
+                            ProgressiveBVHBuilder   (const ProgressiveBVHBuilder&); // forbidden
+    ProgressiveBVHBuilder&  operator=               (const ProgressiveBVHBuilder&); // forbidden
+
+private:
+    BVH&                    m_bvh;
+    BVH::BuildParams        m_params;           // Refinements do not print, report progress, gather stats or poll the cancel flag.
+    BVH::BuildParams        m_coarseParams;     // The coarse tree is built in the caller's thread, so it reports progress and polls the cancel flag.
+    S64                     m_startTicks;
+
+    MulticoreLauncher       m_launcher;
+    Array<CoarseLeaf>       m_leaves;
+    Array<BVHNode*>         m_retired;
+
+    Spinlock                m_lock;             // Protects the members below.
+    S32                     m_numTriIndices;    // Entries of BVH::getTriIndices() in use; the rest is reserved.
+    S32                     m_numRefined;
+    S32                     m_numPublished;     // Deterministic builds: leaves handled in order so far.
+    volatile bool           m_stopped;
+};
+
+//------------------------------------------------------------------------
+}
@@ -0,0 +1,105 @@
+#include "SampleRays.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+namespace
+{
+
+struct WeightedSAHContext
+{
+    const Platform*     platform;
+    const Ray*          rays;
+    Array<S32>          rayStack;       // Rays hitting each node on the current path.
+    F32                 rootArea;
+    S32                 numRootHits;
+    F32                 rayWeight;
+    F32                 sah;
+};
+
+//------------------------------------------------------------------------
+
+void computeWeightedProbabilities(WeightedSAHContext& ctx, BVHNode* node, S32 numRays)
+{
+    // The rays hitting the node are on top of the stack.
+
+    F32 weight = getRayWeightedArea(node->m_bounds, numRays, ctx.rootArea, ctx.numRootHits, ctx.rayWeight);
+    node->m_probability = (ctx.rootArea > 0.0f) ? weight / ctx.rootArea : 0.0f;
+    ctx.sah += node->m_probability * ctx.platform->getCost(node->getNumChildNodes(), node->getNumTriangles());
+
+    int start = ctx.rayStack.getSize() - numRays;
+    for (int c = 0; c < node->getNumChildNodes(); c++)
+    {
+        BVHNode* child = node->getChildNode(c);
+        child->m_parentProbability = node->m_probability;
+
+        int end = start + numRays;
+        for (int i = start; i < end; i++)
+        {
+            S32 rayIdx = ctx.rayStack[i];
+            if (rayHitsBox(ctx.rays[rayIdx], child->m_bounds))
+                ctx.rayStack.add(rayIdx);
+        }
+
+        computeWeightedProbabilities(ctx, child, ctx.rayStack.getSize() - end);
+        ctx.rayStack.resize(end);
+    }
+}
+
+}
+
+//------------------------------------------------------------------------
+
+void FW::appendFrustumRays(Array<Ray>& rays, const Mat4f& worldToClip, int numX, int numY)
+{
+    // Unproject cell centers at the near and far planes (clip space z = -1 and 1).
+
+    Mat4f clipToWorld = worldToClip.inverted();
+    for (int y = 0; y < numY; y++)
+    {
+        for (int x = 0; x < numX; x++)
+        {
+            Vec2f pos(((F32)x + 0.5f) / (F32)numX * 2.0f - 1.0f, ((F32)y + 0.5f) / (F32)numY * 2.0f - 1.0f);
+            Vec3f nearPos = (clipToWorld * Vec4f(pos, -1.0f, 1.0f)).toCartesian();
+            Vec3f farPos = (clipToWorld * Vec4f(pos, 1.0f, 1.0f)).toCartesian();
+
+            Ray& ray = rays.add();
+            ray.origin = nearPos;
+            ray.direction = farPos - nearPos;
+            ray.tmin = 0.0f;
+            ray.tmax = 1.0f;
+        }
+    }
+}
+
+//------------------------------------------------------------------------
+
+F32 FW::computeRayWeightedSAH(BVHNode* root, const Platform& platform, const Ray* rays, S32 numRays, F32 rayWeight)
+{
+    WeightedSAHContext ctx;
+    ctx.platform    = &platform;
+    ctx.rays        = rays;
+    ctx.rootArea    = root->m_bounds.area();
+    ctx.rayWeight   = rayWeight;
+    ctx.sah         = 0.0f;
+
+    for (int i = 0; i < numRays; i++)
+        if (rayHitsBox(rays[i], root->m_bounds))
+            ctx.rayStack.add(i);
+
+    // No rays hit the scene => plain surface area.
+
+    ctx.numRootHits = ctx.rayStack.getSize();
+    if (!ctx.numRootHits)
+    {
+        ctx.numRootHits = 1;
+        ctx.rayWeight = 0.0f;
+    }
+
+    computeWeightedProbabilities(ctx, root, ctx.rayStack.getSize());
+    root->m_parentProbability = 1.0f;
+    return ctx.sah;
+}
+
+//------------------------------------------------------------------------
@@ -0,0 +1,20 @@
+#pragma once
+#include "BVHNode.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Sample rays for builds weighted by the ray distribution
+// (BVH::BuildParams::sampleRays). A box is weighted by a blend of its
+// surface area and the fraction of sample rays that hit it, scaled so
+// that the root weighs exactly its surface area.
+//------------------------------------------------------------------------
+
+inline bool     rayHitsBox              (const Ray& ray, const AABB& box)   { Vec2f t = Intersect::RayBox(box, ray); return (t.x <= t.y && t.y >= ray.tmin && t.x <= ray.tmax); }
+inline F32      getRayWeightedArea      (const AABB& box, S32 numHits, F32 rootArea, S32 numRootHits, F32 rayWeight) { return lerp(box.area(), rootArea * (F32)numHits / (F32)numRootHits, rayWeight); }
+
+void            appendFrustumRays       (Array<Ray>& rays, const Mat4f& worldToClip, int numX, int numY);                 // One ray per cell of a numX x numY grid, from the near plane to the far plane.
+F32             computeRayWeightedSAH   (BVHNode* root, const Platform& platform, const Ray* rays, S32 numRays, F32 rayWeight); // Also sets the node probabilities.
+
+//------------------------------------------------------------------------
+}
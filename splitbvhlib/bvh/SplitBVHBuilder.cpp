@@ -32,12 +32,30 @@ using namespace FW;
 
 //------------------------------------------------------------------------
 
-SplitBVHBuilder::SplitBVHBuilder(BVH& bvh, const BVH::BuildParams& params)
+SplitBVHBuilder::SplitBVHBuilder(BVH& bvh, const BVH::BuildParams& params, Scratch* scratch, BVHNodeArena* nodeArena)
 :   m_bvh           (bvh),
     m_platform      (bvh.getPlatform()),
     m_params        (params),
+    m_triSubset     (NULL),
+    m_numTris       (0),
+    m_triIndices    (NULL),
+    m_nodeArena     (nodeArena),
+    m_triVerts      ((scratch) ? scratch->triVerts : m_ownScratch.triVerts),
+    m_refStack      ((scratch) ? scratch->refStack : m_ownScratch.refStack),
+    m_refTemp       ((scratch) ? scratch->refTemp : m_ownScratch.refTemp),
+    m_sortKeys      ((scratch) ? scratch->sortKeys : m_ownScratch.sortKeys),
+    m_bestSortKeys  (-1),
     m_minOverlap    (0.0f),
-    m_sortDim       (-1)
+    m_maxSpatialBins(0),
+    m_rightBounds   ((scratch) ? scratch->rightBounds : m_ownScratch.rightBounds),
+    m_leftBounds    ((scratch) ? scratch->leftBounds : m_ownScratch.leftBounds),
+    m_rays          (NULL),
+    m_rootArea      (0.0f),
+    m_numRootHits   (0),
+    m_rayStack      ((scratch) ? scratch->rayStack : m_ownScratch.rayStack),
+    m_rayTemp       ((scratch) ? scratch->rayTemp : m_ownScratch.rayTemp),
+    m_leftHits      ((scratch) ? scratch->leftHits : m_ownScratch.leftHits),
+    m_rightHits     ((scratch) ? scratch->rightHits : m_ownScratch.rightHits)
 {
 }
 
@@ -51,40 +69,101 @@ SplitBVHBuilder::~SplitBVHBuilder(void)
 
 BVHNode* SplitBVHBuilder::run(void)
 {
-    // Initialize reference stack and determine root bounds.
+    return run(NULL, m_bvh.getScene()->getNumTriangles(), m_bvh.getTriIndices());
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* SplitBVHBuilder::run(const S32* triSubset, S32 numTris, Array<S32>& triIndices)
+{
+    m_triSubset = triSubset;
+    m_numTris = numTris;
+    m_triIndices = &triIndices;
+
+    // Gather the vertices of each triangle into a contiguous buffer,
+    // so that splitReference() does not need to go through the index buffer.
 
     const Vec3i* tris = (const Vec3i*)m_bvh.getScene()->getTriVtxIndexBufferPtr();
     const Vec3f* verts = (const Vec3f*)m_bvh.getScene()->getVtxPosBufferPtr();
 
+    m_triVerts.resize(numTris * 3);
+    for (int i = 0; i < numTris; i++)
+    {
+        const Vec3i& inds = tris[(triSubset) ? triSubset[i] : i];
+        for (int j = 0; j < 3; j++)
+            m_triVerts[i * 3 + j] = verts[inds[j]];
+    }
+
+    // Initialize reference stack and determine root bounds.
+    // Duplicates never exceed the budget of the root, so the stack is allocated once.
+
     NodeSpec rootSpec;
-    rootSpec.numRef = m_bvh.getScene()->getNumTriangles();
+    rootSpec.numRef = numTris;
+    rootSpec.maxDuplicates = (S32)((F32)numTris * max(m_params.duplicateBudget, 0.0f));
+    m_refStack.reserve(rootSpec.numRef + rootSpec.maxDuplicates);
     m_refStack.resize(rootSpec.numRef);
 
     for (int i = 0; i < rootSpec.numRef; i++)
     {
-        m_refStack[i].triIdx = i;
+        Reference ref;
+        ref.triIdx = i;
         for (int j = 0; j < 3; j++)
-            m_refStack[i].bounds.grow(verts[tris[i][j]]);
-        rootSpec.bounds.grow(m_refStack[i].bounds);
+            ref.bounds.grow(m_triVerts[i * 3 + j]);
+        m_refStack.set(i, ref);
+        rootSpec.bounds.grow(ref.bounds);
     }
 
     // Initialize rest of the members.
 
     m_minOverlap = rootSpec.bounds.area() * m_params.splitAlpha;
-    m_rightBounds.reset(max(rootSpec.numRef, (int)NumSpatialBins) - 1);
+    m_maxSpatialBins = clamp(m_params.spatialBins, (S32)MinSpatialBins, (S32)MaxSpatialBins);
+    m_rightBounds.resize(max(rootSpec.numRef, m_maxSpatialBins) - 1);
+
+    // Gather the sample rays that hit the scene.
+    // None of them do => weight by surface area only.
+
+    m_rays = NULL;
+    m_rayStack.clear();
+    for (int i = 0; i < m_params.numSampleRays; i++)
+        if (rayHitsBox(m_params.sampleRays[i], rootSpec.bounds))
+            m_rayStack.add(i);
+
+    if (m_rayStack.getSize())
+    {
+        m_rays = m_params.sampleRays;
+        m_rootArea = rootSpec.bounds.area();
+        m_numRootHits = m_rayStack.getSize();
+        rootSpec.numRays = m_rayStack.getSize();
+        m_leftBounds.resize(m_rightBounds.getSize());
+        m_leftHits.resize(m_rightBounds.getSize());
+        m_rightHits.resize(m_rightBounds.getSize());
+    }
     m_numDuplicates = 0;
     m_progressTimer.start();
 
     // Build recursively.
+    // Common batch sizes get a specialized path; anything else reads them from the platform.
 
-    BVHNode* root = buildNode(rootSpec, 0, 0.0f, 1.0f);
-    m_bvh.getTriIndices().compact();
+    BVHNode* root;
+    if (m_platform.getTriangleBatchSize() == 1 && m_platform.getNodeBatchSize() == 1)
+        root = buildNode(rootSpec, 0, 0.0f, 1.0f, FixedCost<1, 1>(m_platform));
+    else if (m_platform.getTriangleBatchSize() == 4 && m_platform.getNodeBatchSize() == 4)
+        root = buildNode(rootSpec, 0, 0.0f, 1.0f, FixedCost<4, 4>(m_platform));
+    else
+        root = buildNode(rootSpec, 0, 0.0f, 1.0f, RuntimeCost(m_platform));
+
+    // Arena => the buffers are reused by the next build, keep their capacity.
+
+    if (!m_nodeArena)
+        m_triIndices->compact();
 
     // Done.
 
+    if (m_params.progressFunc)
+        m_params.progressFunc(m_params.progressData, 100.0f, (F32)m_numDuplicates / (F32)m_numTris * 100.0f);
     if (m_params.enablePrints)
         printf("SplitBVHBuilder: progress %.0f%%, duplicates %.0f%%\n",
-            100.0f, (F32)m_numDuplicates / (F32)m_bvh.getScene()->getNumTriangles() * 100.0f);
+            100.0f, (F32)m_numDuplicates / (F32)m_numTris * 100.0f);
     return root;
 }
 
@@ -92,42 +171,85 @@ BVHNode* SplitBVHBuilder::run(void)
 
 bool SplitBVHBuilder::sortCompare(void* data, int idxA, int idxB)
 {
-    const SplitBVHBuilder* ptr = (const SplitBVHBuilder*)data;
-    int dim = ptr->m_sortDim;
-    const Reference& ra = ptr->m_refStack[idxA];
-    const Reference& rb = ptr->m_refStack[idxB];
-    F32 ca = ra.bounds.min()[dim] + ra.bounds.max()[dim];
-    F32 cb = rb.bounds.min()[dim] + rb.bounds.max()[dim];
-    return (ca < cb || (ca == cb && ra.triIdx < rb.triIdx));
+    const SortKey& ka = ((const SortKey*)data)[idxA];
+    const SortKey& kb = ((const SortKey*)data)[idxB];
+    return (ka.centroid < kb.centroid || (ka.centroid == kb.centroid && ka.triIdx < kb.triIdx));
 }
 
 //------------------------------------------------------------------------
 
 void SplitBVHBuilder::sortSwap(void* data, int idxA, int idxB)
 {
-    SplitBVHBuilder* ptr = (SplitBVHBuilder*)data;
-    swap(ptr->m_refStack[idxA], ptr->m_refStack[idxB]);
+    swap(((SortKey*)data)[idxA], ((SortKey*)data)[idxB]);
 }
 
 //------------------------------------------------------------------------
 
-BVHNode* SplitBVHBuilder::buildNode(NodeSpec spec, int level, F32 progressStart, F32 progressEnd)
+void SplitBVHBuilder::sortReferences(Array<SortKey>& keys, const NodeSpec& spec, int dim)
 {
-    // Display progress.
+    // Gather keys for the references of the node and sort them along the given dimension.
+    // The references themselves stay where they are.
+
+    int start = m_refStack.getSize() - spec.numRef;
+    const S32* triIdx = m_refStack.triIdx.getPtr(start);
+    const Vec3f* centroid = m_refStack.centroid.getPtr(start);
 
-    if (m_params.enablePrints && m_progressTimer.getElapsed() >= 1.0f)
+    keys.resize(spec.numRef);
+    for (int i = 0; i < spec.numRef; i++)
     {
-        printf("SplitBVHBuilder: progress %.0f%%, duplicates %.0f%%\r",
-            progressStart * 100.0f, (F32)m_numDuplicates / (F32)m_bvh.getScene()->getNumTriangles() * 100.0f);
+        keys[i].centroid = centroid[i][dim];
+        keys[i].triIdx = triIdx[i];
+        keys[i].refIdx = start + i;
+    }
+    sort(keys.getPtr(), 0, spec.numRef, sortCompare, sortSwap);
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::permuteReferences(const Array<SortKey>& keys, const NodeSpec& spec)
+{
+    // Reorder the references of the node to match the sorted keys.
+
+    int start = m_refStack.getSize() - spec.numRef;
+    m_refTemp.resize(spec.numRef);
+    for (int i = 0; i < spec.numRef; i++)
+    {
+        int j = keys[i].refIdx;
+        m_refTemp.triIdx[i] = m_refStack.triIdx[j];
+        m_refTemp.boundsMin[i] = m_refStack.boundsMin[j];
+        m_refTemp.boundsMax[i] = m_refStack.boundsMax[j];
+        m_refTemp.centroid[i] = m_refStack.centroid[j];
+    }
+
+    m_refStack.triIdx.setRange(start, m_refTemp.triIdx);
+    m_refStack.boundsMin.setRange(start, m_refTemp.boundsMin);
+    m_refStack.boundsMax.setRange(start, m_refTemp.boundsMax);
+    m_refStack.centroid.setRange(start, m_refTemp.centroid);
+}
+
+//------------------------------------------------------------------------
+
+template <class Cost> BVHNode* SplitBVHBuilder::buildNode(NodeSpec spec, int level, F32 progressStart, F32 progressEnd, const Cost& cost)
+{
+    // Report progress.
+
+    if (m_params.progressFunc && m_progressTimer.getElapsed() >= 0.1f)
+    {
+        m_params.progressFunc(m_params.progressData, progressStart * 100.0f, (F32)m_numDuplicates / (F32)m_numTris * 100.0f);
         m_progressTimer.start();
     }
 
+    // Cancelled => finish quickly with whatever is left as a leaf.
+
+    if (m_params.cancel && *m_params.cancel)
+        return createLeaf(spec);
+
     // Remove degenerates.
     {
         int firstRef = m_refStack.getSize() - spec.numRef;
         for (int i = m_refStack.getSize() - 1; i >= firstRef; i--)
         {
-            Vec3f size = m_refStack[i].bounds.max() - m_refStack[i].bounds.min();
+            Vec3f size = m_refStack.boundsMax[i] - m_refStack.boundsMin[i];
             if (min(size) < 0.0f || sum(size) == max(size))
                 m_refStack.removeSwap(i);
         }
@@ -141,18 +263,18 @@ BVHNode* SplitBVHBuilder::buildNode(NodeSpec spec, int level, F32 progressStart,
 
     // Find split candidates.
 
-    F32 area = spec.bounds.area();
-    F32 leafSAH = area * m_platform.getTriangleCost(spec.numRef);
-    F32 nodeSAH = area * m_platform.getNodeCost(2);
-    ObjectSplit object = findObjectSplit(spec, nodeSAH);
+    F32 area = getWeightedArea(spec.bounds, spec.numRays);
+    F32 leafSAH = area * cost.getTriangleCost(spec.numRef);
+    F32 nodeSAH = area * cost.getNodeCost(2);
+    ObjectSplit object = findObjectSplit(spec, nodeSAH, cost);
 
     SpatialSplit spatial;
-    if (level < MaxSpatialDepth)
+    if (level < MaxSpatialDepth && spec.maxDuplicates > 0)
     {
         AABB overlap = object.leftBounds;
         overlap.intersect(object.rightBounds);
         if (overlap.area() >= m_minOverlap)
-            spatial = findSpatialSplit(spec, nodeSAH);
+            spatial = findSpatialSplit(spec, nodeSAH, cost);
     }
 
     // Leaf SAH is the lowest => create leaf.
@@ -164,71 +286,124 @@ BVHNode* SplitBVHBuilder::buildNode(NodeSpec spec, int level, F32 progressStart,
     // Perform split.
 
     NodeSpec left, right;
+    int splitAxis = spatial.dim;
     if (minSAH == spatial.sah)
-        performSpatialSplit(left, right, spec, spatial);
+        performSpatialSplit(left, right, spec, spatial, cost);
     if (!left.numRef || !right.numRef)
+    {
         performObjectSplit(left, right, spec, object);
+        splitAxis = object.sortDim;
+    }
+
+    if (m_rays)
+        partitionRays(left, right, spec);
+
+    // Hand the rest of the duplicate budget to the children by area.
+
+    S32 numDuplicates = left.numRef + right.numRef - spec.numRef;
+    S32 budget = spec.maxDuplicates - numDuplicates;
+    F32 leftArea = left.bounds.area();
+    F32 rightArea = right.bounds.area();
+    left.maxDuplicates = (leftArea + rightArea > 0.0f) ? (S32)((F32)budget * leftArea / (leftArea + rightArea)) : budget / 2;
+    right.maxDuplicates = budget - left.maxDuplicates;
 
     // Create inner node.
 
-    m_numDuplicates += left.numRef + right.numRef - spec.numRef;
+    m_numDuplicates += numDuplicates;
     F32 progressMid = lerp(progressStart, progressEnd, (F32)right.numRef / (F32)(left.numRef + right.numRef));
-    BVHNode* rightNode = buildNode(right, level + 1, progressStart, progressMid);
-    BVHNode* leftNode = buildNode(left, level + 1, progressMid, progressEnd);
-    return new InnerNode(spec.bounds, leftNode, rightNode);
+    BVHNode* rightNode = buildNode(right, level + 1, progressStart, progressMid, cost);
+    BVHNode* leftNode = buildNode(left, level + 1, progressMid, progressEnd, cost);
+    return (m_nodeArena) ? m_nodeArena->newInner(spec.bounds, leftNode, rightNode, splitAxis) : new InnerNode(spec.bounds, leftNode, rightNode, splitAxis);
 }
 
 //------------------------------------------------------------------------
 
 BVHNode* SplitBVHBuilder::createLeaf(const NodeSpec& spec)
 {
-    Array<S32>& tris = m_bvh.getTriIndices();
+    m_rayStack.resize(m_rayStack.getSize() - spec.numRays);
+
+    Array<S32>& tris = *m_triIndices;
     for (int i = 0; i < spec.numRef; i++)
-        tris.add(m_refStack.removeLast().triIdx);
-    return new LeafNode(spec.bounds, tris.getSize() - spec.numRef, tris.getSize());
+    {
+        S32 triIdx = m_refStack.removeLast();
+        tris.add((m_triSubset) ? m_triSubset[triIdx] : triIdx);
+    }
+    int lo = tris.getSize() - spec.numRef;
+    return (m_nodeArena) ? m_nodeArena->newLeaf(spec.bounds, lo, tris.getSize()) : new LeafNode(spec.bounds, lo, tris.getSize());
 }
 
 //------------------------------------------------------------------------
 
-SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplit(const NodeSpec& spec, F32 nodeSAH)
+template <class Cost> SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplit(const NodeSpec& spec, F32 nodeSAH, const Cost& cost)
 {
     ObjectSplit split;
-    const Reference* refPtr = m_refStack.getPtr(m_refStack.getSize() - spec.numRef);
+    const Vec3f* boundsMin = m_refStack.boundsMin.getPtr();
+    const Vec3f* boundsMax = m_refStack.boundsMax.getPtr();
     F32 bestTieBreak = FW_F32_MAX;
+    int currSortKeys = 0;
+    m_bestSortKeys = -1;
 
     // Sort along each dimension.
+    // The keys of the best dimension so far are kept for performObjectSplit().
 
-    for (m_sortDim = 0; m_sortDim < 3; m_sortDim++)
+    for (int dim = 0; dim < 3; dim++)
     {
-        sort(this, m_refStack.getSize() - spec.numRef, m_refStack.getSize(), sortCompare, sortSwap);
+        const Array<SortKey>& keys = m_sortKeys[currSortKeys];
+        sortReferences(m_sortKeys[currSortKeys], spec, dim);
 
         // Sweep right to left and determine bounds.
 
         AABB rightBounds;
         for (int i = spec.numRef - 1; i > 0; i--)
         {
-            rightBounds.grow(refPtr[i].bounds);
+            int j = keys[i].refIdx;
+            rightBounds.grow(AABB(boundsMin[j], boundsMax[j]));
             m_rightBounds[i - 1] = rightBounds;
         }
 
+        // Weighted by sample rays => count hits on both sides of each candidate.
+
+        if (m_rays)
+        {
+            AABB leftBounds;
+            for (int i = 1; i < spec.numRef; i++)
+            {
+                int j = keys[i - 1].refIdx;
+                leftBounds.grow(AABB(boundsMin[j], boundsMax[j]));
+                m_leftBounds[i - 1] = leftBounds;
+            }
+            countSweepHits(spec, spec.numRef - 1);
+        }
+
         // Sweep left to right and select lowest SAH.
 
         AABB leftBounds;
+        bool improved = false;
         for (int i = 1; i < spec.numRef; i++)
         {
-            leftBounds.grow(refPtr[i - 1].bounds);
-            F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(i) + m_rightBounds[i - 1].area() * m_platform.getTriangleCost(spec.numRef - i);
+            int j = keys[i - 1].refIdx;
+            leftBounds.grow(AABB(boundsMin[j], boundsMax[j]));
+            F32 leftArea = (m_rays) ? getWeightedArea(leftBounds, m_leftHits[i - 1]) : leftBounds.area();
+            F32 rightArea = (m_rays) ? getWeightedArea(m_rightBounds[i - 1], m_rightHits[i - 1]) : m_rightBounds[i - 1].area();
+            F32 sah = nodeSAH + leftArea * cost.getTriangleCost(i) + rightArea * cost.getTriangleCost(spec.numRef - i);
             F32 tieBreak = sqr((F32)i) + sqr((F32)(spec.numRef - i));
             if (sah < split.sah || (sah == split.sah && tieBreak < bestTieBreak))
             {
                 split.sah = sah;
-                split.sortDim = m_sortDim;
+                split.sortDim = dim;
                 split.numLeft = i;
                 split.leftBounds = leftBounds;
                 split.rightBounds = m_rightBounds[i - 1];
                 bestTieBreak = tieBreak;
+                improved = true;
             }
         }
+
+        if (improved)
+        {
+            m_bestSortKeys = currSortKeys;
+            currSortKeys ^= 1;
+        }
     }
     return split;
 }
@@ -237,8 +412,17 @@ SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplit(const NodeSpec& sp
 
 void SplitBVHBuilder::performObjectSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split)
 {
-    m_sortDim = split.sortDim;
-    sort(this, m_refStack.getSize() - spec.numRef, m_refStack.getSize(), sortCompare, sortSwap);
+    // No sort keys if findObjectSplit() found no split, or if a spatial
+    // split was tried since and moved the references => sort again.
+
+    if (m_bestSortKeys == -1)
+    {
+        m_bestSortKeys = 0;
+        sortReferences(m_sortKeys[0], spec, split.sortDim);
+    }
+
+    permuteReferences(m_sortKeys[m_bestSortKeys], spec);
+    m_bestSortKeys = -1;
 
     left.numRef = split.numLeft;
     left.bounds = split.leftBounds;
@@ -248,17 +432,19 @@ void SplitBVHBuilder::performObjectSplit(NodeSpec& left, NodeSpec& right, const
 
 //------------------------------------------------------------------------
 
-SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec& spec, F32 nodeSAH)
+template <class Cost> SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec& spec, F32 nodeSAH, const Cost& cost)
 {
-    // Initialize bins.
+    // Initialize bins. Adaptive => about one bin per reference, so that
+    // clearing and sweeping the bins costs no more than filling them.
 
+    int numBins = (m_params.adaptiveBins) ? clamp(spec.numRef, (int)MinSpatialBins, m_maxSpatialBins) : m_maxSpatialBins;
     Vec3f origin = spec.bounds.min();
-    Vec3f binSize = (spec.bounds.max() - origin) * (1.0f / (F32)NumSpatialBins);
+    Vec3f binSize = (spec.bounds.max() - origin) * (1.0f / (F32)numBins);
     Vec3f invBinSize = 1.0f / binSize;
 
     for (int dim = 0; dim < 3; dim++)
     {
-        for (int i = 0; i < NumSpatialBins; i++)
+        for (int i = 0; i < numBins; i++)
         {
             SpatialBin& bin = m_bins[dim][i];
             bin.bounds = AABB();
@@ -271,9 +457,9 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
 
     for (int refIdx = m_refStack.getSize() - spec.numRef; refIdx < m_refStack.getSize(); refIdx++)
     {
-        const Reference& ref = m_refStack[refIdx];
-        Vec3i firstBin = clamp(Vec3i((ref.bounds.min() - origin) * invBinSize), 0, NumSpatialBins - 1);
-        Vec3i lastBin = clamp(Vec3i((ref.bounds.max() - origin) * invBinSize), firstBin, NumSpatialBins - 1);
+        const Reference ref = m_refStack.get(refIdx);
+        Vec3i firstBin = clamp(Vec3i((ref.bounds.min() - origin) * invBinSize), 0, numBins - 1);
+        Vec3i lastBin = clamp(Vec3i((ref.bounds.max() - origin) * invBinSize), firstBin, numBins - 1);
 
         for (int dim = 0; dim < 3; dim++)
         {
@@ -299,25 +485,40 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
         // Sweep right to left and determine bounds.
 
         AABB rightBounds;
-        for (int i = NumSpatialBins - 1; i > 0; i--)
+        for (int i = numBins - 1; i > 0; i--)
         {
             rightBounds.grow(m_bins[dim][i].bounds);
             m_rightBounds[i - 1] = rightBounds;
         }
 
+        // Weighted by sample rays => count hits on both sides of each candidate.
+
+        if (m_rays)
+        {
+            AABB leftBounds;
+            for (int i = 1; i < numBins; i++)
+            {
+                leftBounds.grow(m_bins[dim][i - 1].bounds);
+                m_leftBounds[i - 1] = leftBounds;
+            }
+            countSweepHits(spec, numBins - 1);
+        }
+
         // Sweep left to right and select lowest SAH.
 
         AABB leftBounds;
         int leftNum = 0;
         int rightNum = spec.numRef;
 
-        for (int i = 1; i < NumSpatialBins; i++)
+        for (int i = 1; i < numBins; i++)
         {
             leftBounds.grow(m_bins[dim][i - 1].bounds);
             leftNum += m_bins[dim][i - 1].enter;
             rightNum -= m_bins[dim][i - 1].exit;
 
-            F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(leftNum) + m_rightBounds[i - 1].area() * m_platform.getTriangleCost(rightNum);
+            F32 leftArea = (m_rays) ? getWeightedArea(leftBounds, m_leftHits[i - 1]) : leftBounds.area();
+            F32 rightArea = (m_rays) ? getWeightedArea(m_rightBounds[i - 1], m_rightHits[i - 1]) : m_rightBounds[i - 1].area();
+            F32 sah = nodeSAH + leftArea * cost.getTriangleCost(leftNum) + rightArea * cost.getTriangleCost(rightNum);
             if (sah < split.sah)
             {
                 split.sah = sah;
@@ -331,7 +532,7 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
 
 //------------------------------------------------------------------------
 
-void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split)
+template <class Cost> void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split, const Cost& cost)
 {
     // Categorize references and compute bounds.
     //
@@ -339,28 +540,30 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
     // Uncategorized/split: [leftEnd, rightStart[
     // Right-hand side:     [rightStart, refs.getSize()[
 
-    Array<Reference>& refs = m_refStack;
+    ReferenceStack& refs = m_refStack;
     int leftStart = refs.getSize() - spec.numRef;
     int leftEnd = leftStart;
     int rightStart = refs.getSize();
+    int numDuplicates = 0;
     left.bounds = right.bounds = AABB();
+    m_bestSortKeys = -1;
 
     for (int i = leftEnd; i < rightStart; i++)
     {
         // Entirely on the left-hand side?
 
-        if (refs[i].bounds.max()[split.dim] <= split.pos)
+        if (refs.boundsMax[i][split.dim] <= split.pos)
         {
-            left.bounds.grow(refs[i].bounds);
-            swap(refs[i], refs[leftEnd++]);
+            left.bounds.grow(refs.getBounds(i));
+            refs.swap(i, leftEnd++);
         }
 
         // Entirely on the right-hand side?
 
-        else if (refs[i].bounds.min()[split.dim] >= split.pos)
+        else if (refs.boundsMin[i][split.dim] >= split.pos)
         {
-            right.bounds.grow(refs[i].bounds);
-            swap(refs[i--], refs[--rightStart]);
+            right.bounds.grow(refs.getBounds(i));
+            refs.swap(i--, --rightStart);
         }
     }
 
@@ -370,28 +573,30 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
     {
         // Split reference.
 
+        Reference ref = refs.get(leftEnd);
         Reference lref, rref;
-        splitReference(lref, rref, refs[leftEnd], split.dim, split.pos);
+        splitReference(lref, rref, ref, split.dim, split.pos);
 
         // Compute SAH for duplicate/unsplit candidates.
+        // Duplicating is not an option once the budget of the node is spent.
 
         AABB lub = left.bounds;  // Unsplit to left:     new left-hand bounds.
         AABB rub = right.bounds; // Unsplit to right:    new right-hand bounds.
         AABB ldb = left.bounds;  // Duplicate:           new left-hand bounds.
         AABB rdb = right.bounds; // Duplicate:           new right-hand bounds.
-        lub.grow(refs[leftEnd].bounds);
-        rub.grow(refs[leftEnd].bounds);
+        lub.grow(ref.bounds);
+        rub.grow(ref.bounds);
         ldb.grow(lref.bounds);
         rdb.grow(rref.bounds);
 
-        F32 lac = m_platform.getTriangleCost(leftEnd - leftStart);
-        F32 rac = m_platform.getTriangleCost(refs.getSize() - rightStart);
-        F32 lbc = m_platform.getTriangleCost(leftEnd - leftStart + 1);
-        F32 rbc = m_platform.getTriangleCost(refs.getSize() - rightStart + 1);
+        F32 lac = cost.getTriangleCost(leftEnd - leftStart);
+        F32 rac = cost.getTriangleCost(refs.getSize() - rightStart);
+        F32 lbc = cost.getTriangleCost(leftEnd - leftStart + 1);
+        F32 rbc = cost.getTriangleCost(refs.getSize() - rightStart + 1);
 
         F32 unsplitLeftSAH = lub.area() * lbc + right.bounds.area() * rac;
         F32 unsplitRightSAH = left.bounds.area() * lac + rub.area() * rbc;
-        F32 duplicateSAH = ldb.area() * lbc + rdb.area() * rbc;
+        F32 duplicateSAH = (numDuplicates < spec.maxDuplicates) ? ldb.area() * lbc + rdb.area() * rbc : FW_F32_MAX;
         F32 minSAH = min(unsplitLeftSAH, unsplitRightSAH, duplicateSAH);
 
         // Unsplit to left?
@@ -407,7 +612,7 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
         else if (minSAH == unsplitRightSAH)
         {
             right.bounds = rub;
-            swap(refs[leftEnd], refs[--rightStart]);
+            refs.swap(leftEnd, --rightStart);
         }
 
         // Duplicate?
@@ -416,8 +621,9 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
         {
             left.bounds = ldb;
             right.bounds = rdb;
-            refs[leftEnd++] = lref;
+            refs.set(leftEnd++, lref);
             refs.add(rref);
+            numDuplicates++;
         }
     }
 
@@ -427,50 +633,129 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
 
 //------------------------------------------------------------------------
 
-void SplitBVHBuilder::splitReference(Reference& left, Reference& right, const Reference& ref, int dim, F32 pos)
+void SplitBVHBuilder::splitTriangleBounds(AABB& left, AABB& right, const Vec3f* triVerts, const AABB& bounds, int dim, F32 pos)
 {
-    // Initialize references.
+    // Initialize bounds.
 
-    left.triIdx = right.triIdx = ref.triIdx;
-    left.bounds = right.bounds = AABB();
+    left = right = AABB();
 
     // Loop over vertices/edges.
 
-    const Vec3i* tris = (const Vec3i*)m_bvh.getScene()->getTriVtxIndexBufferPtr();
-    const Vec3f* verts = (const Vec3f*)m_bvh.getScene()->getVtxPosBufferPtr();
-    const Vec3i& inds = tris[ref.triIdx];
-    const Vec3f* v1 = &verts[inds.z];
+    const Vec3f* v1 = &triVerts[2];
 
     for (int i = 0; i < 3; i++)
     {
         const Vec3f* v0 = v1;
-        v1 = &verts[inds[i]];
+        v1 = &triVerts[i];
         F32 v0p = v0->get(dim);
         F32 v1p = v1->get(dim);
 
         // Insert vertex to the boxes it belongs to.
 
         if (v0p <= pos)
-            left.bounds.grow(*v0);
+            left.grow(*v0);
         if (v0p >= pos)
-            right.bounds.grow(*v0);
+            right.grow(*v0);
 
         // Edge intersects the plane => insert intersection to both boxes.
 
         if ((v0p < pos && v1p > pos) || (v0p > pos && v1p < pos))
         {
             Vec3f t = lerp(*v0, *v1, clamp((pos - v0p) / (v1p - v0p), 0.0f, 1.0f));
-            left.bounds.grow(t);
-            right.bounds.grow(t);
+            left.grow(t);
+            right.grow(t);
         }
     }
 
     // Intersect with original bounds.
 
-    left.bounds.max()[dim] = pos;
-    right.bounds.min()[dim] = pos;
-    left.bounds.intersect(ref.bounds);
-    right.bounds.intersect(ref.bounds);
+    left.max()[dim] = pos;
+    right.min()[dim] = pos;
+    left.intersect(bounds);
+    right.intersect(bounds);
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::splitReference(Reference& left, Reference& right, const Reference& ref, int dim, F32 pos)
+{
+    left.triIdx = right.triIdx = ref.triIdx;
+    splitTriangleBounds(left.bounds, right.bounds, m_triVerts.getPtr(ref.triIdx * 3), ref.bounds, dim, pos);
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::countSweepHits(const NodeSpec& spec, int numCandidates)
+{
+    // m_leftBounds grows and m_rightBounds shrinks with the candidate index,
+    // so a ray hits the left-hand boxes from some index onwards, and the
+    // right-hand boxes up to some index. Find those by binary search.
+
+    for (int i = 0; i < numCandidates; i++)
+    {
+        m_leftHits[i] = 0;
+        m_rightHits[i] = 0;
+    }
+
+    for (int i = m_rayStack.getSize() - spec.numRays; i < m_rayStack.getSize(); i++)
+    {
+        const Ray& ray = m_rays[m_rayStack[i]];
+
+        int lo = 0;
+        int hi = numCandidates;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) >> 1;
+            if (rayHitsBox(ray, m_leftBounds[mid]))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (lo < numCandidates)
+            m_leftHits[lo]++;
+
+        lo = 0;
+        hi = numCandidates;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) >> 1;
+            if (rayHitsBox(ray, m_rightBounds[mid]))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo > 0)
+            m_rightHits[lo - 1]++;
+    }
+
+    for (int i = 1; i < numCandidates; i++)
+        m_leftHits[i] += m_leftHits[i - 1];
+    for (int i = numCandidates - 2; i >= 0; i--)
+        m_rightHits[i] += m_rightHits[i + 1];
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::partitionRays(NodeSpec& left, NodeSpec& right, const NodeSpec& spec)
+{
+    // Replace the rays of the node with those of the children.
+    // The right child is built first, so its rays go on top.
+
+    int start = m_rayStack.getSize() - spec.numRays;
+    m_rayTemp.clear();
+
+    for (int i = start; i < m_rayStack.getSize(); i++)
+        if (rayHitsBox(m_rays[m_rayStack[i]], left.bounds))
+            m_rayTemp.add(m_rayStack[i]);
+    left.numRays = m_rayTemp.getSize();
+
+    for (int i = start; i < m_rayStack.getSize(); i++)
+        if (rayHitsBox(m_rays[m_rayStack[i]], right.bounds))
+            m_rayTemp.add(m_rayStack[i]);
+    right.numRays = m_rayTemp.getSize() - left.numRays;
+
+    m_rayStack.resize(start);
+    m_rayStack.add(m_rayTemp);
 }
 
 //------------------------------------------------------------------------
@@ -27,6 +27,7 @@
 
 #pragma once
 #include "BVH.hpp"
+#include "SampleRays.hpp"
 #include "base/Timer.hpp"
 
 namespace FW
@@ -40,7 +41,8 @@ private:
     {
         MaxDepth        = 64,
         MaxSpatialDepth = 48,
-        NumSpatialBins  = 128,
+        MinSpatialBins  = 8,
+        MaxSpatialBins  = 256,
     };
 
     struct Reference
@@ -51,12 +53,60 @@ private:
         Reference(void) : triIdx(-1) {}
     };
 
+    struct ReferenceStack // Structure-of-arrays storage for references.
+    {
+        Array<S32>          triIdx;
+        Array<Vec3f>        boundsMin;
+        Array<Vec3f>        boundsMax;
+        Array<Vec3f>        centroid;   // boundsMin + boundsMax, i.e. twice the box center.
+
+        S32                 getSize     (void) const                { return triIdx.getSize(); }
+        AABB                getBounds   (S32 idx) const             { return AABB(boundsMin[idx], boundsMax[idx]); }
+        Reference           get         (S32 idx) const             { Reference ref; ref.triIdx = triIdx[idx]; ref.bounds = getBounds(idx); return ref; }
+
+        void                reserve     (S32 capacity)              { triIdx.reserve(capacity); boundsMin.reserve(capacity); boundsMax.reserve(capacity); centroid.reserve(capacity); }
+        void                resize      (S32 size)                  { triIdx.resize(size); boundsMin.resize(size); boundsMax.resize(size); centroid.resize(size); }
+        void                set         (S32 idx, const Reference& ref) { triIdx[idx] = ref.triIdx; boundsMin[idx] = ref.bounds.min(); boundsMax[idx] = ref.bounds.max(); centroid[idx] = ref.bounds.min() + ref.bounds.max(); }
+        void                add         (const Reference& ref)      { resize(getSize() + 1); set(getSize() - 1, ref); }
+        void                swap        (S32 idxA, S32 idxB)        { FW::swap(triIdx[idxA], triIdx[idxB]); FW::swap(boundsMin[idxA], boundsMin[idxB]); FW::swap(boundsMax[idxA], boundsMax[idxB]); FW::swap(centroid[idxA], centroid[idxB]); }
+        void                removeSwap  (S32 idx)                   { triIdx.removeSwap(idx); boundsMin.removeSwap(idx); boundsMax.removeSwap(idx); centroid.removeSwap(idx); }
+        S32                 removeLast  (void)                      { boundsMin.removeLast(); boundsMax.removeLast(); centroid.removeLast(); return triIdx.removeLast(); }
+    };
+
+    struct SortKey // Sorted instead of the references themselves.
+    {
+        F32                 centroid;
+        S32                 triIdx;
+        S32                 refIdx;
+    };
+
+    struct RuntimeCost // Batch sizes and costs read from the platform.
+    {
+        const Platform&     platform;
+
+        explicit RuntimeCost(const Platform& p) : platform(p) {}
+        F32                 getTriangleCost (S32 n) const           { return platform.getTriangleCost(n); }
+        F32                 getNodeCost     (S32 n) const           { return platform.getNodeCost(n); }
+    };
+
+    template <U32 TriBatchSize, U32 NodeBatchSize> struct FixedCost // Batch sizes known at compile time, so rounding needs no divides.
+    {
+        F32                 triCost;
+        F32                 nodeCost;
+
+        explicit FixedCost(const Platform& p) : triCost(p.getSAHTriangleCost()), nodeCost(p.getSAHNodeCost()) {}
+        F32                 getTriangleCost (S32 n) const           { return (F32)(((U32)n + TriBatchSize - 1) / TriBatchSize * TriBatchSize) * triCost; }
+        F32                 getNodeCost     (S32 n) const           { return (F32)(((U32)n + NodeBatchSize - 1) / NodeBatchSize * NodeBatchSize) * nodeCost; }
+    };
+
     struct NodeSpec
     {
         S32                 numRef;
+        S32                 maxDuplicates;  // References the subtree may still add through spatial splits.
+        S32                 numRays;        // Sample rays hitting the node, on top of m_rayStack.
         AABB                bounds;
 
-        NodeSpec(void) : numRef(0) {}
+        NodeSpec(void) : numRef(0), maxDuplicates(0), numRays(0) {}
     };
 
     struct ObjectSplit
@@ -87,25 +137,49 @@ private:
     };
 
 public:
-                            SplitBVHBuilder     (BVH& bvh, const BVH::BuildParams& params);
+    struct Scratch // Buffers that only ever grow, so that consecutive builds can share them.
+    {
+        Array<Vec3f>        triVerts;
+        ReferenceStack      refStack;
+        ReferenceStack      refTemp;
+        Array<SortKey>      sortKeys[2];
+        Array<AABB>         rightBounds;
+        Array<AABB>         leftBounds;
+        Array<S32>          rayStack;
+        Array<S32>          rayTemp;
+        Array<S32>          leftHits;
+        Array<S32>          rightHits;
+    };
+
+public:
+                            SplitBVHBuilder     (BVH& bvh, const BVH::BuildParams& params, Scratch* scratch = NULL, BVHNodeArena* nodeArena = NULL);
                             ~SplitBVHBuilder    (void);
 
     BVHNode*                run                 (void);
+    BVHNode*                run                 (const S32* triSubset, S32 numTris, Array<S32>& triIndices); // Leaf ranges refer to triIndices.
+
+    static void             splitTriangleBounds (AABB& left, AABB& right, const Vec3f* triVerts, const AABB& bounds, int dim, F32 pos); // Clips the part of the triangle within bounds at the plane.
 
 private:
     static bool             sortCompare         (void* data, int idxA, int idxB);
     static void             sortSwap            (void* data, int idxA, int idxB);
+    void                    sortReferences      (Array<SortKey>& keys, const NodeSpec& spec, int dim);
+    void                    permuteReferences   (const Array<SortKey>& keys, const NodeSpec& spec);
 
-    BVHNode*                buildNode           (NodeSpec spec, int level, F32 progressStart, F32 progressEnd);
-    BVHNode*                createLeaf          (const NodeSpec& spec);
+    template <class Cost> BVHNode*      buildNode           (NodeSpec spec, int level, F32 progressStart, F32 progressEnd, const Cost& cost);
+    BVHNode*                            createLeaf          (const NodeSpec& spec);
 
-    ObjectSplit             findObjectSplit     (const NodeSpec& spec, F32 nodeSAH);
-    void                    performObjectSplit  (NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split);
+    template <class Cost> ObjectSplit   findObjectSplit     (const NodeSpec& spec, F32 nodeSAH, const Cost& cost);
+    void                                performObjectSplit  (NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split);
 
-    SpatialSplit            findSpatialSplit    (const NodeSpec& spec, F32 nodeSAH);
-    void                    performSpatialSplit (NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split);
+    template <class Cost> SpatialSplit  findSpatialSplit    (const NodeSpec& spec, F32 nodeSAH, const Cost& cost);
+    template <class Cost> void          performSpatialSplit (NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split, const Cost& cost);
     void                    splitReference      (Reference& left, Reference& right, const Reference& ref, int dim, F32 pos);
 
+    F32                     getWeightedArea     (const AABB& bounds, S32 numHits) const { return (m_rays) ? getRayWeightedArea(bounds, numHits, m_rootArea, m_numRootHits, m_params.rayWeight) : bounds.area(); }
+    void                    countSweepHits      (const NodeSpec& spec, int numCandidates);
+    void                    partitionRays       (NodeSpec& left, NodeSpec& right, const NodeSpec& spec);
+
 private:
                             SplitBVHBuilder     (const SplitBVHBuilder&); // forbidden
     SplitBVHBuilder&        operator=           (const SplitBVHBuilder&); // forbidden
@@ -115,11 +189,30 @@ private:
     const Platform&         m_platform;
     const BVH::BuildParams& m_params;
 
-    Array<Reference>        m_refStack;
+    const S32*              m_triSubset;            // Local triangle index => scene triangle index, or NULL for all triangles.
+    S32                     m_numTris;
+    Array<S32>*             m_triIndices;
+    BVHNodeArena*           m_nodeArena;            // NULL => nodes are allocated with new.
+
+    Scratch                 m_ownScratch;           // Used when the caller does not provide one.
+    Array<Vec3f>&           m_triVerts;             // Three vertices per triangle, in triangle order.
+    ReferenceStack&         m_refStack;
+    ReferenceStack&         m_refTemp;
+    Array<SortKey>*         m_sortKeys;             // [2]
+    S32                     m_bestSortKeys;         // Index into m_sortKeys, or -1 if m_refStack has changed since findObjectSplit().
     F32                     m_minOverlap;
-    Array<AABB>             m_rightBounds;
-    S32                     m_sortDim;
-    SpatialBin              m_bins[3][NumSpatialBins];
+    Array<AABB>&            m_rightBounds;
+    Array<AABB>&            m_leftBounds;           // Only with sample rays.
+    S32                     m_maxSpatialBins;       // BuildParams::spatialBins, clamped.
+    SpatialBin              m_bins[3][MaxSpatialBins];
+
+    const Ray*              m_rays;                 // Sample rays weighting the SAH, or NULL for surface area only.
+    F32                     m_rootArea;
+    S32                     m_numRootHits;
+    Array<S32>&             m_rayStack;
+    Array<S32>&             m_rayTemp;
+    Array<S32>&             m_leftHits;             // Rays hitting the left-hand box of each split candidate.
+    Array<S32>&             m_rightHits;
 
     Timer                   m_progressTimer;
     S32                     m_numDuplicates;
@@ -0,0 +1,404 @@
+#include "TreeStats.hpp"
+#include "base/MulticoreLauncher.hpp"
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+namespace
+{
+
+enum
+{
+    TaskDepth       = 8,    // Fixed, so that the float sums do not depend on the core count.
+    EPOChunkSize    = 4096,
+};
+
+struct StatsTotals
+{
+    StatsTotals(void)   { memset(overlapArea, 0, sizeof(overlapArea)); memset(innerArea, 0, sizeof(innerArea)); }
+
+    BVH::Stats          stats;
+    F32                 overlapArea[BVH::Stats::NumDepthBins];
+    F32                 innerArea[BVH::Stats::NumDepthBins];
+};
+
+struct Subtree
+{
+    BVHNode*            node;
+    F32                 probability;
+    S32                 depth;
+};
+
+struct StatsContext
+{
+    const Platform*     platform;
+    LeafNode**          refLeaves;      // Leaf of each entry of the triangle indices.
+    S32                 taskDepth;
+    StatsTotals         top;
+    Array<Subtree>      subtrees;
+    Array<StatsTotals>  subtreeTotals;
+};
+
+struct EPOContext
+{
+    const Platform*     platform;
+    const BVHNode*      root;
+    const Vec3i*        tris;
+    const Vec3f*        verts;
+    const S32*          triOffsets;     // Leaves of triangle t: triLeaves[triOffsets[t] .. triOffsets[t + 1]].
+    const LeafNode*const* triLeaves;
+    S32                 numTris;
+    Array<F64>          epo;            // Per task.
+    Array<F64>          area;           // Per task.
+};
+
+//------------------------------------------------------------------------
+
+inline F32 getChildProbability(const BVHNode* node, const BVHNode* child, F32 probability)
+{
+    return (probability > 0.0f) ? probability * child->getArea() / node->getArea() : 0.0f;
+}
+
+//------------------------------------------------------------------------
+
+inline bool boxesOverlap(const AABB& a, const AABB& b)
+{
+    return (a.min().x <= b.max().x && a.min().y <= b.max().y && a.min().z <= b.max().z &&
+            b.min().x <= a.max().x && b.min().y <= a.max().y && b.min().z <= a.max().z);
+}
+
+//------------------------------------------------------------------------
+// A triangle meets a plane perpendicular to an axis it extends along in a
+// segment at most. Boxes that only touch it on such an axis cover no area.
+
+inline bool overlapsArea(const AABB& box, const AABB& triBounds)
+{
+    for (int i = 0; i < 3; i++)
+        if (triBounds.min()[i] < triBounds.max()[i] && (box.max()[i] <= triBounds.min()[i] || box.min()[i] >= triBounds.max()[i]))
+            return false;
+    return true;
+}
+
+//------------------------------------------------------------------------
+
+void accumulateNode(StatsContext& ctx, StatsTotals& totals, BVHNode* node, F32 probability, S32 depth)
+{
+    BVH::Stats& s = totals.stats;
+    int bin = min(depth, (S32)BVH::Stats::NumDepthBins - 1);
+    F32 sah = probability * ctx.platform->getCost(node->getNumChildNodes(), node->getNumTriangles());
+    node->m_probability = probability;
+    s.SAHCost += sah;
+    s.sahByDepth[bin] += sah;
+    s.maxDepth = max(s.maxDepth, depth);
+
+    if (node->isLeaf())
+    {
+        LeafNode* leaf = (LeafNode*)node;
+        s.numLeafNodes++;
+        s.numTris += leaf->getNumTriangles();
+        s.depthHistogram[bin]++;
+        s.leafSizeHistogram[min(leaf->getNumTriangles(), (S32)BVH::Stats::NumLeafSizeBins - 1)]++;
+        for (int i = leaf->m_lo; i < leaf->m_hi; i++)
+            ctx.refLeaves[i] = leaf;
+        return;
+    }
+
+    s.numInnerNodes++;
+    s.numChildNodes += node->getNumChildNodes();
+    totals.innerArea[bin] += node->getArea();
+
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+    {
+        for (int j = i + 1; j < node->getNumChildNodes(); j++)
+        {
+            AABB shared = node->getChildNode(i)->m_bounds;
+            shared.intersect(node->getChildNode(j)->m_bounds);
+            totals.overlapArea[bin] += shared.area();
+        }
+    }
+}
+
+//------------------------------------------------------------------------
+
+void walkSubtree(StatsContext& ctx, StatsTotals& totals, BVHNode* node, F32 probability, S32 depth)
+{
+    accumulateNode(ctx, totals, node, probability, depth);
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+    {
+        BVHNode* child = node->getChildNode(i);
+        child->m_parentProbability = probability;
+        walkSubtree(ctx, totals, child, getChildProbability(node, child, probability), depth + 1);
+    }
+}
+
+//------------------------------------------------------------------------
+
+void walkTop(StatsContext& ctx, BVHNode* node, F32 probability, S32 depth)
+{
+    if (depth == ctx.taskDepth && !node->isLeaf())
+    {
+        Subtree& subtree    = ctx.subtrees.add();
+        subtree.node        = node;
+        subtree.probability = probability;
+        subtree.depth       = depth;
+        return;
+    }
+
+    accumulateNode(ctx, ctx.top, node, probability, depth);
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+    {
+        BVHNode* child = node->getChildNode(i);
+        child->m_parentProbability = probability;
+        walkTop(ctx, child, getChildProbability(node, child, probability), depth + 1);
+    }
+}
+
+//------------------------------------------------------------------------
+
+void subtreeTask(MulticoreLauncher::Task& task)
+{
+    StatsContext& ctx = *(StatsContext*)task.data;
+    const Subtree& subtree = ctx.subtrees[task.idx];
+    walkSubtree(ctx, ctx.subtreeTotals[task.idx], subtree.node, subtree.probability, subtree.depth);
+}
+
+//------------------------------------------------------------------------
+
+void mergeTotals(StatsTotals& dst, const StatsTotals& src)
+{
+    dst.stats.SAHCost       += src.stats.SAHCost;
+    dst.stats.numInnerNodes += src.stats.numInnerNodes;
+    dst.stats.numLeafNodes  += src.stats.numLeafNodes;
+    dst.stats.numChildNodes += src.stats.numChildNodes;
+    dst.stats.numTris       += src.stats.numTris;
+    dst.stats.maxDepth      = max(dst.stats.maxDepth, src.stats.maxDepth);
+
+    for (int i = 0; i < BVH::Stats::NumDepthBins; i++)
+    {
+        dst.stats.depthHistogram[i] += src.stats.depthHistogram[i];
+        dst.stats.sahByDepth[i]     += src.stats.sahByDepth[i];
+        dst.overlapArea[i]          += src.overlapArea[i];
+        dst.innerArea[i]            += src.innerArea[i];
+    }
+    for (int i = 0; i < BVH::Stats::NumLeafSizeBins; i++)
+        dst.stats.leafSizeHistogram[i] += src.stats.leafSizeHistogram[i];
+}
+
+//------------------------------------------------------------------------
+// Adds the cost of the nodes that overlap the triangle but do not contain
+// it, and returns whether the subtree contains the triangle. Boxes that do
+// not touch the bounds of the triangle can neither overlap nor contain it.
+
+bool accumulateEPO(const EPOContext& ctx, const BVHNode* node, const Vec3f* v, const AABB& triBounds, const LeafNode*const* leaves, int numLeaves, F64& epo)
+{
+    if (!boxesOverlap(node->m_bounds, triBounds))
+        return false;
+
+    bool contains = false;
+    if (node->isLeaf())
+    {
+        for (int i = 0; i < numLeaves; i++)
+            contains |= (leaves[i] == node);
+    }
+    else
+    {
+        for (int i = 0; i < node->getNumChildNodes(); i++)
+            contains |= accumulateEPO(ctx, node->getChildNode(i), v, triBounds, leaves, numLeaves, epo);
+    }
+
+    if (!contains && overlapsArea(node->m_bounds, triBounds))
+        epo += ctx.platform->getCost(node->getNumChildNodes(), node->getNumTriangles()) * getClippedArea(v[0], v[1], v[2], node->m_bounds);
+    return contains;
+}
+
+//------------------------------------------------------------------------
+
+void epoTask(MulticoreLauncher::Task& task)
+{
+    EPOContext& ctx = *(EPOContext*)task.data;
+    F64 epo = 0.0;
+    F64 area = 0.0;
+
+    int end = min((task.idx + 1) * EPOChunkSize, ctx.numTris);
+    for (int t = task.idx * EPOChunkSize; t < end; t++)
+    {
+        // Triangles dropped by the builder are not part of the tree.
+
+        int numLeaves = ctx.triOffsets[t + 1] - ctx.triOffsets[t];
+        if (!numLeaves)
+            continue;
+
+        const Vec3i& tri = ctx.tris[t];
+        Vec3f v[3] = { ctx.verts[tri.x], ctx.verts[tri.y], ctx.verts[tri.z] };
+        AABB triBounds;
+        for (int i = 0; i < 3; i++)
+            triBounds.grow(v[i]);
+
+        accumulateEPO(ctx, ctx.root, v, triBounds, ctx.triLeaves + ctx.triOffsets[t], numLeaves, epo);
+        area += (v[1] - v[0]).cross(v[2] - v[0]).length() * 0.5f;
+    }
+
+    ctx.epo[task.idx] = epo;
+    ctx.area[task.idx] = area;
+}
+
+//------------------------------------------------------------------------
+// Single-core => the same tasks in order on the calling thread, e.g. from
+// inside a task of another launcher.
+
+void runTasks(MulticoreLauncher::TaskFunc func, void* data, int numTasks, bool multicore)
+{
+    if (multicore)
+    {
+        MulticoreLauncher().push(func, data, 0, numTasks).popAll();
+        return;
+    }
+
+    MulticoreLauncher::Task task;
+    task.launcher   = NULL;
+    task.func       = func;
+    task.data       = data;
+    task.result     = NULL;
+    for (task.idx = 0; task.idx < numTasks; task.idx++)
+        func(task);
+}
+
+}
+
+//------------------------------------------------------------------------
+
+F32 FW::getClippedArea(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const AABB& box)
+{
+    // Clip against the six planes of the box; each plane adds at most one vertex.
+
+    Vec3f poly[2][9];
+    poly[0][0] = v0;
+    poly[0][1] = v1;
+    poly[0][2] = v2;
+    int n = 3;
+    int cur = 0;
+
+    for (int plane = 0; plane < 6; plane++)
+    {
+        int axis = plane >> 1;
+        bool upper = ((plane & 1) != 0);
+        const Vec3f* in = poly[cur];
+        Vec3f* out = poly[cur ^ 1];
+        int m = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            const Vec3f& a = in[i];
+            const Vec3f& b = in[(i + 1 == n) ? 0 : i + 1];
+            F32 da = (upper) ? box.max()[axis] - a[axis] : a[axis] - box.min()[axis];
+            F32 db = (upper) ? box.max()[axis] - b[axis] : b[axis] - box.min()[axis];
+
+            if (da >= 0.0f)
+                out[m++] = a;
+            if ((da < 0.0f) != (db < 0.0f))
+                out[m++] = lerp(a, b, da / (da - db));
+        }
+
+        n = m;
+        cur ^= 1;
+        if (n < 3)
+            return 0.0f;
+    }
+
+    Vec3f sum = 0.0f;
+    for (int i = 1; i + 1 < n; i++)
+        sum += (poly[cur][i] - poly[cur][0]).cross(poly[cur][i + 1] - poly[cur][0]);
+    return sum.length() * 0.5f;
+}
+
+//------------------------------------------------------------------------
+
+void FW::computeTreeStats(const BVH& bvh, BVH::Stats& stats, bool multicore)
+{
+    BVHNode* root = bvh.getRoot();
+    SceneBVH* scene = bvh.getScene();
+    const Array<S32>& triIndices = bvh.getTriIndices();
+
+    // Walk the top levels serially, leaving up to 2^TaskDepth subtrees.
+
+    Array<LeafNode*> refLeaves;
+    refLeaves.reset(triIndices.getSize());
+    memset(refLeaves.getPtr(), 0, refLeaves.getNumBytes());
+
+    StatsContext ctx;
+    ctx.platform    = &bvh.getPlatform();
+    ctx.refLeaves   = refLeaves.getPtr();
+    ctx.taskDepth   = TaskDepth;
+
+    walkTop(ctx, root, 1.0f, 0);
+    root->m_parentProbability = 1.0f;
+
+    ctx.subtreeTotals.reset(ctx.subtrees.getSize());
+    runTasks(subtreeTask, &ctx, ctx.subtrees.getSize(), multicore);
+    for (int i = 0; i < ctx.subtreeTotals.getSize(); i++)
+        mergeTotals(ctx.top, ctx.subtreeTotals[i]);
+
+    stats = ctx.top.stats;
+    stats.branchingFactor = 2;
+
+    F32 overlapArea = 0.0f;
+    F32 innerArea = 0.0f;
+    for (int i = 0; i < BVH::Stats::NumDepthBins; i++)
+    {
+        stats.overlapByDepth[i] = (ctx.top.innerArea[i] > 0.0f) ? ctx.top.overlapArea[i] / ctx.top.innerArea[i] : 0.0f;
+        overlapArea += ctx.top.overlapArea[i];
+        innerArea += ctx.top.innerArea[i];
+    }
+    stats.overlapRatio = (innerArea > 0.0f) ? overlapArea / innerArea : 0.0f;
+
+    // Group the leaves by triangle for the EPO pass. Entries no leaf refers
+    // to are the refinement reserve of a progressive build.
+
+    int numTris = scene->getNumTriangles();
+    Array<S32> triOffsets;
+    triOffsets.reset(numTris + 1);
+    memset(triOffsets.getPtr(), 0, triOffsets.getNumBytes());
+    for (int i = 0; i < triIndices.getSize(); i++)
+        if (refLeaves[i])
+            triOffsets[triIndices[i] + 1]++;
+    int numReferenced = 0;
+    for (int i = 0; i < numTris; i++)
+    {
+        numReferenced += (triOffsets[i + 1] != 0);
+        triOffsets[i + 1] += triOffsets[i];
+    }
+    stats.duplicateRatio = (numReferenced) ? (F32)stats.numTris / (F32)numReferenced - 1.0f : 0.0f;
+
+    Array<const LeafNode*> triLeaves;
+    triLeaves.reset(triOffsets[numTris]);
+    Array<S32> cursor(triOffsets.getPtr(), numTris);
+    for (int i = 0; i < triIndices.getSize(); i++)
+        if (refLeaves[i])
+            triLeaves[cursor[triIndices[i]]++] = refLeaves[i];
+
+    EPOContext epo;
+    epo.platform    = ctx.platform;
+    epo.root        = root;
+    epo.tris        = scene->getTriVtxIndexBufferPtr();
+    epo.verts       = scene->getVtxPosBufferPtr();
+    epo.triOffsets  = triOffsets.getPtr();
+    epo.triLeaves   = triLeaves.getPtr();
+    epo.numTris     = numTris;
+
+    int numTasks = (numTris + EPOChunkSize - 1) / EPOChunkSize;
+    epo.epo.reset(numTasks);
+    epo.area.reset(numTasks);
+    runTasks(epoTask, &epo, numTasks, multicore);
+
+    F64 epoSum = 0.0;
+    F64 areaSum = 0.0;
+    for (int i = 0; i < numTasks; i++)
+    {
+        epoSum += epo.epo[i];
+        areaSum += epo.area[i];
+    }
+    stats.EPO = (areaSum > 0.0) ? (F32)(epoSum / areaSum) : 0.0f;
+}
+
+//------------------------------------------------------------------------
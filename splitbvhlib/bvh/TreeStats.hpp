@@ -0,0 +1,17 @@
+#pragma once
+#include "BVH.hpp"
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Tree statistics in one parallel pass. The upper levels of the tree are
+// walked serially and the subtrees below them on separate cores. EPO
+// (end-point overlap, Aila et al. 2013) is then summed per triangle,
+// again in parallel.
+//------------------------------------------------------------------------
+
+void            computeTreeStats        (const BVH& bvh, BVH::Stats& stats, bool multicore = true); // Also sets the node probabilities from surface areas.
+F32             getClippedArea          (const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const AABB& box); // Area of the part of the triangle inside the box.
+
+//------------------------------------------------------------------------
+}
@@ -31,6 +31,48 @@ using namespace FW;
 
 //------------------------------------------------------------------------
 
+void PrecomputedRay::set(const Ray& ray, bool conservative)
+{
+    // Planes are read as offsets from the first float of the box, which
+    // works because AABB stores min and max as six consecutive floats.
+
+    const F32 minDirection = 1.0e-20f;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        F32 d = ray.direction[axis];
+        sign[axis] = (d < 0.0f) ? 1 : 0;
+        parallel[axis] = (FW::abs(d) < minDirection);
+        if (parallel[axis])
+            d = (sign[axis]) ? -minDirection : minDirection;
+
+        invDirection[axis] = 1.0f / d;
+        originInvDirection[axis] = ray.origin[axis] * invDirection[axis];
+        nearOffset[axis] = sign[axis] * 3 + axis;
+        farOffset[axis] = (1 - sign[axis]) * 3 + axis;
+    }
+    origin = ray.origin;
+    tmin = ray.tmin;
+    tmax = ray.tmax;
+    this->conservative = conservative;
+
+    // Shear for the watertight triangle test. x and y are swapped for a
+    // negative z, so that the winding of the triangles is preserved.
+
+    Vec3f absDirection = abs(ray.direction);
+    int kz = (absDirection.x > absDirection.y) ? ((absDirection.x > absDirection.z) ? 0 : 2) : ((absDirection.y > absDirection.z) ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.direction[kz] < 0.0f)
+        swap(kx, ky);
+
+    shearAxis[0] = kx;
+    shearAxis[1] = ky;
+    shearAxis[2] = kz;
+    shear = Vec3f(ray.direction[kx], ray.direction[ky], 1.0f) / ray.direction[kz];
+}
+
+//------------------------------------------------------------------------
+
 Vec2f Intersect::RayBox(const AABB& box, const Ray& ray)
 {
     const Vec3f& orig = ray.origin;
@@ -94,6 +136,57 @@ Vec3f Intersect::RayTriangle(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2,
 }
 
 
+//------------------------------------------------------------------------
+
+Vec3f Intersect::RayTriangleWatertight(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const Ray& ray, const PrecomputedRay& setup)
+{
+    const Vec3f miss(FW_F32_MAX,FW_F32_MAX,FW_F32_MAX);
+    int kx = setup.shearAxis[0];
+    int ky = setup.shearAxis[1];
+    int kz = setup.shearAxis[2];
+
+    // Vertices relative to the origin, sheared so that the ray runs along z.
+    // A vertex shared by two triangles lands at the same point for both.
+
+    Vec3f a = v0 - ray.origin;
+    Vec3f b = v1 - ray.origin;
+    Vec3f c = v2 - ray.origin;
+    F32 ax = a[kx] - setup.shear.x * a[kz];
+    F32 ay = a[ky] - setup.shear.y * a[kz];
+    F32 bx = b[kx] - setup.shear.x * b[kz];
+    F32 by = b[ky] - setup.shear.y * b[kz];
+    F32 cx = c[kx] - setup.shear.x * c[kz];
+    F32 cy = c[ky] - setup.shear.y * c[kz];
+
+    // Scaled barycentrics. On an edge => redo in double precision,
+    // so that both triangles of the edge agree on the sign.
+
+    F32 u = cx * by - cy * bx;
+    F32 v = ax * cy - ay * cx;
+    F32 w = bx * ay - by * ax;
+    if (u == 0.0f || v == 0.0f || w == 0.0f)
+    {
+        u = (F32)((F64)cx * (F64)by - (F64)cy * (F64)bx);
+        v = (F32)((F64)ax * (F64)cy - (F64)ay * (F64)cx);
+        w = (F32)((F64)bx * (F64)ay - (F64)by * (F64)ax);
+    }
+
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+        return miss;
+
+    F32 det = u + v + w;
+    if (det == 0.0f)
+        return miss;
+
+    F32 invDet = 1.0f / det;
+    F32 t = (u * a[kz] + v * b[kz] + w * c[kz]) * setup.shear.z * invDet;
+
+    if(t>ray.tmin && t<ray.tmax)
+        return Vec3f(v * invDet, w * invDet, t);
+
+    return miss;
+}
+
 //------------------------------------------------------------------------
 
 Vec3f Intersect::RayTriangleWoop(const Vec4f& zpleq, const Vec4f& upleq, const Vec4f& vpleq, const Ray& ray)
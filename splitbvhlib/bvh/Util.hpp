@@ -28,6 +28,11 @@
 #pragma once
 #include "base/Math.hpp"
 
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) || defined(__SSE__)
+#   define FW_RAYBOX_SSE 1
+#   include <xmmintrin.h>
+#endif
+
 namespace FW
 {
 //------------------------------------------------------------------------
@@ -76,14 +81,48 @@ struct Ray
 
 struct RayResult
 {
-    inline            RayResult   (S32 ii = RAY_NO_HIT, float ti = 0.f) : id(ii), t(ti) {}
+    inline            RayResult   (S32 ii = RAY_NO_HIT, float ti = 0.f) : id(ii), t(ti), u(0.f), v(0.f) {}
     inline    bool    hit         (void) const    { return (id != RAY_NO_HIT); }
     inline    void    clear       (void)          { id = RAY_NO_HIT; }
 
     S32             id;
     float           t;
-    S32             padA;
-    S32             padB;
+    float           u;              // Barycentric weights of the 2nd and 3rd vertex of the hit triangle.
+    float           v;
+};
+
+//------------------------------------------------------------------------
+// Per-ray constants for repeated box tests. A slab distance is then one
+// multiply-subtract, and the sign of the direction picks the near and far
+// planes without comparing them. Zero direction components are replaced
+// by a tiny value of the same sign, so axis-parallel rays get finite
+// distances instead of NaNs.
+//
+// Conservative setups trade the multiply-subtract for (plane - origin) *
+// invDirection and widen the far distances by the worst-case rounding
+// error, so that a box is never missed by a ray that hits its contents.
+// Axis-parallel rays are tested against the slab itself, as a ray in the
+// plane of a face would otherwise leave the box at t = 0.
+//------------------------------------------------------------------------
+
+struct PrecomputedRay
+{
+    inline            PrecomputedRay  (void)              {}
+    inline explicit   PrecomputedRay  (const Ray& ray, bool conservative = false) { set(ray, conservative); }
+    void              set             (const Ray& ray, bool conservative = false);
+
+    Vec3f           origin;
+    Vec3f           invDirection;
+    Vec3f           originInvDirection; // origin * invDirection
+    float           tmin;
+    float           tmax;               // Lower as hits are found.
+    S32             sign[3];            // 1 if the direction is negative.
+    S32             nearOffset[3];      // Float offset of the near plane within AABB, i.e. min or max.
+    S32             farOffset[3];
+    bool            parallel[3];        // Direction component replaced by the tiny value.
+    S32             shearAxis[3];       // Watertight triangle test: axes permuted so that the largest direction component is z.
+    Vec3f           shear;              // dx/dz, dy/dz and 1/dz along the permuted axes.
+    bool            conservative;
 };
 
 //------------------------------------------------------------------------
@@ -93,6 +132,104 @@ namespace Intersect
     Vec2f RayBox(const AABB& box, const Ray& ray);
     Vec3f RayTriangle(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const Ray& ray);
     Vec3f RayTriangleWoop(const Vec4f& zpleq, const Vec4f& upleq, const Vec4f& vpleq, const Ray& ray);
+
+    // Watertight test (Woop et al. 2013): a ray through a shared edge or vertex
+    // hits at least one of the triangles around it. Same result as RayTriangle().
+    Vec3f RayTriangleWatertight(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const Ray& ray, const PrecomputedRay& setup);
+
+    // Bit i is set if box i overlaps the ray within [tmin, tmax]. Tests four
+    // boxes per SSE instruction. tnear receives the clipped entry distances.
+    // Conservative rays scale the far distances by 1 + 2 * gamma(3), the bound
+    // of Pharr et al., "Physically Based Rendering", 3rd ed., section 3.9.
+    inline U32 RayBoxes(const AABB* const* boxes, int numBoxes, const PrecomputedRay& ray, F32* tnear = NULL);
+}
+
+//------------------------------------------------------------------------
+
+U32 Intersect::RayBoxes(const AABB* const* boxes, int numBoxes, const PrecomputedRay& ray, F32* tnear)
+{
+    const F32 unitRoundoff = 0.5f * 1.1920929e-7f;
+    const F32 farScale = 1.0f + 2.0f * (3.0f * unitRoundoff) / (1.0f - 3.0f * unitRoundoff);
+
+    U32 mask = 0;
+    for (int first = 0; first < numBoxes; first += 4)
+    {
+        // Unused lanes repeat the last box.
+
+        int num = min(numBoxes - first, 4);
+        const F32* b[4];
+        for (int i = 0; i < 4; i++)
+            b[i] = &boxes[first + min(i, num - 1)]->min().x;
+
+#if FW_RAYBOX_SSE
+        __m128 tn = _mm_set1_ps(ray.tmin);
+        __m128 tf = _mm_set1_ps(ray.tmax);
+        __m128 outside = _mm_setzero_ps();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int n = ray.nearOffset[axis];
+            int f = ray.farOffset[axis];
+            __m128 inv = _mm_set1_ps(ray.invDirection[axis]);
+            __m128 oinv = _mm_set1_ps(ray.originInvDirection[axis]);
+            __m128 nearPlane = _mm_setr_ps(b[0][n], b[1][n], b[2][n], b[3][n]);
+            __m128 farPlane = _mm_setr_ps(b[0][f], b[1][f], b[2][f], b[3][f]);
+            if (ray.conservative)
+            {
+                __m128 org = _mm_set1_ps(ray.origin[axis]);
+                if (ray.parallel[axis])
+                {
+                    outside = _mm_or_ps(outside, _mm_cmplt_ps(org, _mm_min_ps(nearPlane, farPlane)));
+                    outside = _mm_or_ps(outside, _mm_cmpgt_ps(org, _mm_max_ps(nearPlane, farPlane)));
+                    continue;
+                }
+                tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(nearPlane, org), inv));
+                tf = _mm_min_ps(tf, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(farPlane, org), inv), _mm_set1_ps(farScale)));
+                continue;
+            }
+            tn = _mm_max_ps(tn, _mm_sub_ps(_mm_mul_ps(nearPlane, inv), oinv));
+            tf = _mm_min_ps(tf, _mm_sub_ps(_mm_mul_ps(farPlane, inv), oinv));
+        }
+        mask |= ((U32)_mm_movemask_ps(_mm_andnot_ps(outside, _mm_cmple_ps(tn, tf))) & ((1u << num) - 1)) << first;
+
+        if (tnear)
+        {
+            F32 t[4];
+            _mm_storeu_ps(t, tn);
+            for (int i = 0; i < num; i++)
+                tnear[first + i] = t[i];
+        }
+#else
+        for (int i = 0; i < num; i++)
+        {
+            F32 tn = ray.tmin;
+            F32 tf = ray.tmax;
+            bool outside = false;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (ray.conservative)
+                {
+                    F32 nearPlane = b[i][ray.nearOffset[axis]];
+                    F32 farPlane = b[i][ray.farOffset[axis]];
+                    if (ray.parallel[axis])
+                    {
+                        outside |= (ray.origin[axis] < FW::min(nearPlane, farPlane) || ray.origin[axis] > FW::max(nearPlane, farPlane));
+                        continue;
+                    }
+                    tn = FW::max(tn, (nearPlane - ray.origin[axis]) * ray.invDirection[axis]);
+                    tf = FW::min(tf, (farPlane - ray.origin[axis]) * ray.invDirection[axis] * farScale);
+                    continue;
+                }
+                tn = FW::max(tn, b[i][ray.nearOffset[axis]] * ray.invDirection[axis] - ray.originInvDirection[axis]);
+                tf = FW::min(tf, b[i][ray.farOffset[axis]] * ray.invDirection[axis] - ray.originInvDirection[axis]);
+            }
+            if (tn <= tf && !outside)
+                mask |= 1u << (first + i);
+            if (tnear)
+                tnear[first + i] = tn;
+        }
+#endif
+    }
+    return mask;
 }
 
 //------------------------------------------------------------------------
@@ -0,0 +1,145 @@
+#include "bvh/BVH.hpp"
+#include "bvh/TreeStats.hpp"
+#include "base/MulticoreLauncher.hpp"
+
+#include <stdlib.h>
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+// Checks BuildParams::deterministic: a progressive build of the same
+// scene must give the same tree, triangle indices and stats for every
+// thread count from 1 to N.
+//
+//   splitbvhtest [maxThreads] [numTris]
+//
+// Returns 0 if all builds match, 1 otherwise.
+//------------------------------------------------------------------------
+
+namespace
+{
+
+struct BuildHashes
+{
+    U32     tree;
+    U32     triIndices;
+    U32     buildStats;     // BuildParams::stats, filled by the constructor.
+    U32     finalStats;     // computeTreeStats() after refinement.
+};
+
+//------------------------------------------------------------------------
+
+void createScene(Array<Vec3i>& tris, Array<Vec3f>& verts, int numTris)
+{
+    // Height field plus some long, thin triangles across it,
+    // so that the build uses both object and spatial splits.
+
+    int res = 1;
+    while (res * res * 2 < numTris)
+        res++;
+
+    for (int y = 0; y <= res; y++)
+        for (int x = 0; x <= res; x++)
+            verts.add(Vec3f((F32)x, (F32)y, sinf((F32)x * 0.3f) * cosf((F32)y * 0.2f) * 3.0f));
+
+    for (int y = 0; y < res; y++)
+    {
+        for (int x = 0; x < res; x++)
+        {
+            int i = y * (res + 1) + x;
+            tris.add(Vec3i(i, i + 1, i + res + 2));
+            tris.add(Vec3i(i, i + res + 2, i + res + 1));
+        }
+    }
+
+    srand(1);
+    for (int i = 0; i < numTris / 50; i++)
+    {
+        int base = verts.getSize();
+        Vec3f pos((F32)(rand() % res), (F32)(rand() % res), 5.0f);
+        verts.add(pos);
+        verts.add(pos + Vec3f((F32)(rand() % res) * 0.5f, 0.3f, 1.0f));
+        verts.add(pos + Vec3f(0.2f, (F32)(rand() % res) * 0.5f, -1.0f));
+        tris.add(Vec3i(base, base + 1, base + 2));
+    }
+}
+
+//------------------------------------------------------------------------
+
+U32 hashTree(const BVHNode* node, U32 h)
+{
+    h = hashBits(h, node->isLeaf(), hash<AABB>(node->m_bounds));
+    if (node->isLeaf())
+    {
+        const LeafNode* leaf = (const LeafNode*)node;
+        return hashBits(h, leaf->m_lo, leaf->m_hi);
+    }
+
+    for (int i = 0; i < node->getNumChildNodes(); i++)
+        h = hashTree(node->getChildNode(i), h);
+    return h;
+}
+
+//------------------------------------------------------------------------
+
+BuildHashes buildAndHash(SceneBVH& scene, const Platform& platform, int numThreads)
+{
+    MulticoreLauncher::setNumThreads(numThreads);
+
+    BVH::Stats buildStats;
+    BVH::BuildParams params;
+    params.stats = &buildStats;
+    params.progressive = true;
+    params.deterministic = true;
+
+    BVH bvh(&scene, platform, params);
+    bvh.waitForRefinement();
+
+    BVH::Stats finalStats;
+    computeTreeStats(bvh, finalStats);
+
+    const Array<S32>& triIndices = bvh.getTriIndices();
+    BuildHashes res;
+    res.tree        = hashTree(bvh.getRoot(), 0);
+    res.triIndices  = hashArray(triIndices.getPtr(), triIndices.getSize());
+    res.buildStats  = hash<BVH::Stats>(buildStats);
+    res.finalStats  = hash<BVH::Stats>(finalStats);
+    return res;
+}
+
+}
+
+//------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : MulticoreLauncher::getNumCores();
+    int numTris = (argc > 2) ? atoi(argv[2]) : 20000;
+
+    Array<Vec3i> tris;
+    Array<Vec3f> verts;
+    createScene(tris, verts, numTris);
+    SceneBVH scene(tris.getPtr(), verts.getPtr(), tris.getSize(), verts.getSize());
+    Platform platform;
+
+    BuildHashes ref;
+    int numFailed = 0;
+    for (int numThreads = 1; numThreads <= max(maxThreads, 1); numThreads++)
+    {
+        BuildHashes res = buildAndHash(scene, platform, numThreads);
+        if (numThreads == 1)
+            ref = res;
+
+        bool match = (res.tree == ref.tree && res.triIndices == ref.triIndices && res.buildStats == ref.buildStats && res.finalStats == ref.finalStats);
+        FW::printf("%2d threads: tree %08x, triIndices %08x, stats %08x/%08x %s\n",
+            numThreads, res.tree, res.triIndices, res.buildStats, res.finalStats, (match) ? "ok" : "MISMATCH");
+
+        if (!match)
+            numFailed++;
+    }
+
+    FW::printf("%s\n", (numFailed) ? "FAILED" : "PASSED");
+    return (numFailed) ? 1 : 0;
+}
+
+//------------------------------------------------------------------------
@@ -2,6 +2,8 @@
 #include "../vismtv_modeling_vera/launch_header.h"
 
 #include <iostream>
+#include <memory>
+#include <mutex>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -74,7 +76,14 @@ bool __core_function_launcher(VmFnContainer* _fncontainer, helpers_lamda& helper
 	//Mat rgb_img = imread("D:\\Data\\߰\\0709_data\\rgb_capture_4.png");
 	Mat rgb_img = imread("D:\\Data\\߰\\0624_data\\rgb_capture_4.png");
 	//Mat rgb_img = imread("D:\\window_result\\0704\\rgb_capture_1.png");
-	fill_rgb_matching_map(rgb_map.data, indexmap, w, h, rgb_img.data, w, h, mat_p_rgb, pos_pts);
+	bool rgb_occlusion = _fncontainer->fnParams.GetParam("_bool_rgbocclusion", false);
+	if (rgb_occlusion)
+	{
+		double depth_tolerance = _fncontainer->fnParams.GetParam("_double_rgbocclusiontolerance", 0.01);
+		fill_rgb_matching_map_visible(rgb_map.data, NULL, indexmap, w, h, rgb_img.data, rgb_img.cols, rgb_img.rows, mat_p_rgb, pos_pts, (float)depth_tolerance);
+	}
+	else
+		fill_rgb_matching_map(rgb_map.data, indexmap, w, h, rgb_img.data, w, h, mat_p_rgb, pos_pts);
 
 
 	__float3* normalmap = new __float3[w*h];
@@ -86,13 +95,15 @@ bool __core_function_launcher(VmFnContainer* _fncontainer, helpers_lamda& helper
 	double kernelnormal = _fncontainer->fnParams.GetParam("_double_kernelnormal", 0.01);
 	int nbrpixsnormal = _fncontainer->fnParams.GetParam("_int_nbrpixnormal", (int)5);
 	bool use_kdtnormal = _fncontainer->fnParams.GetParam("_bool_usekdtnormal", true);
-	normal_estimation(normalmap, eigenvaluemap, indexmap, mask, w, h, pos_pts, kernelnormal, nbrpixsnormal, use_kdtnormal);
+	bool use_kdtcurv = _fncontainer->fnParams.GetParam("_bool_usekdtcurv", true);
+	std::shared_ptr<point_kdtree> kdt;
+	if (use_kdtnormal || use_kdtcurv) kdt = acquire_point_kdtree(pos_pts);
+	normal_estimation(normalmap, eigenvaluemap, indexmap, mask, w, h, pos_pts, kernelnormal, nbrpixsnormal, use_kdtnormal, kdt.get());
 
 	double kernelcurv = _fncontainer->fnParams.GetParam("_double_kernelcurv", 0.02);
 	int nbrpixscurv = _fncontainer->fnParams.GetParam("_int_nbrpixcurv", (int)10);
-	bool use_kdtcurv = _fncontainer->fnParams.GetParam("_bool_usekdtcurv", true);
 	bool use_nurmcurv = _fncontainer->fnParams.GetParam("_bool_usekdtnumerical", false);
-	curvature_estimation_ver1(curvmap, indexmap, normalmap, mask, w, h, pos_pts, kernelcurv, nbrpixscurv, use_kdtcurv, use_nurmcurv);
+	curvature_estimation_ver1(curvmap, indexmap, normalmap, mask, w, h, pos_pts, kernelcurv, nbrpixscurv, use_kdtcurv, use_nurmcurv, kdt.get());
 
 	/////////////////////////////
 	// ui out
@@ -367,11 +378,90 @@ void fill_rgb_matching_map(byte* rgbmap, const int* indexmap, const int w, const
 	}
 	cout << "test pixels : " << testcnt << endl;
 }
+void fill_rgb_matching_map_visible(byte* rgbmap, byte* visiblemap, const int* indexmap, const int w, const int h,
+	const byte* rgbimg, const int w1, const int h1,
+	const glm::dmat4x4& mat_p, const std::vector<__float3>& pos_pts, const float depth_tolerance)
+{
+	const float max_depth = 1000000.f;
+	const float min_depth = 0.00001f;
+	const int num_pts = (int)pos_pts.size();
+
+	// z-buffer of the rgb camera, with the same 2x2 footprint as fill_organized_pointset_buffers
+	DWORD dwTime = timeGetTime();
+	vector<glm::fvec3> proj_pts(num_pts);
+#pragma omp parallel for
+	for (int i = 0; i < num_pts; i++)
+	{
+		const __float3& fp = pos_pts[i];
+		glm::dvec4 p = mat_p * glm::dvec4((double)fp.x, (double)fp.y, (double)fp.z, 1.0);
+		proj_pts[i] = glm::fvec3((float)(p.x / p.z), (float)(p.y / p.z), (float)p.z);
+	}
+
+	vector<float> zbuffer(w1 * h1, max_depth);
+	for (int i = 0; i < num_pts; i++)
+	{
+		const glm::fvec3& p = proj_pts[i];
+		// behind the rgb camera or off its image, checked before the int casts (out of range or nan otherwise)
+		if (p.z <= min_depth || !(p.x >= -1.f && p.y >= -1.f && p.x < (float)w1 && p.y < (float)h1)) continue;
+		int x = (int)floor(p.x);
+		int y = (int)floor(p.y);
+		for (int k = 0; k < 4; k++)
+		{
+			int xk = x + (k & 1), yk = y + (k >> 1);
+			if (xk < 0 || yk < 0 || xk >= w1 || yk >= h1) continue;
+			SELF_OP(zbuffer[xk + yk * w1], p.z, min);
+		}
+	}
+
+	auto load_byte_buffer = [&](int x, int y) -> vmfloat3
+	{
+		if (x < 0 || y < 0 || x >= w1 || y >= h1) return vmfloat3(0);
+		byte r = rgbimg[(x + y * w1) * 3 + 0];
+		byte g = rgbimg[(x + y * w1) * 3 + 1];
+		byte b = rgbimg[(x + y * w1) * 3 + 2];
+		return vmfloat3((float)r, (float)g, (float)b);
+	};
+
+	// a point is visible if nothing splatted at its rgb pixel is nearer than depth_tolerance
+	int occluded_pixels = 0;
+#pragma omp parallel for reduction(+ : occluded_pixels)
+	for (int i = 0; i < w*h; i++)
+	{
+		rgbmap[i * 3 + 0] = rgbmap[i * 3 + 1] = rgbmap[i * 3 + 2] = 0;
+		if (visiblemap) visiblemap[i] = 0;
+
+		int idx = indexmap[i];
+		if (idx < 0) continue;
+
+		const glm::fvec3& p = proj_pts[idx];
+		if (p.z <= min_depth || !(p.x >= 0.f && p.y >= 0.f && p.x < (float)w1 && p.y < (float)h1)) continue;
+		float x = floor(p.x);
+		float y = floor(p.y);
+		int ix = (int)x;
+		int iy = (int)y;
+		if (p.z > zbuffer[ix + iy * w1] + depth_tolerance)
+		{
+			occluded_pixels++;
+			continue;
+		}
+
+		float ratio_x = p.x - x;
+		float ratio_y = p.y - y;
+		vmfloat3 clr0 = load_byte_buffer(ix, iy) * (1.f - ratio_x) + load_byte_buffer(ix + 1, iy) * ratio_x;
+		vmfloat3 clr1 = load_byte_buffer(ix, iy + 1) * (1.f - ratio_x) + load_byte_buffer(ix + 1, iy + 1) * ratio_x;
+		vmfloat3 clr = clr0 * (1.f - ratio_y) + clr1 * ratio_y;
+		rgbmap[i * 3 + 0] = (byte)min(clr.x, 255.f);
+		rgbmap[i * 3 + 1] = (byte)min(clr.y, 255.f);
+		rgbmap[i * 3 + 2] = (byte)min(clr.z, 255.f);
+		if (visiblemap) visiblemap[i] = 1;
+	}
+	cout << "occluded pixels : " << occluded_pixels << ", " << timeGetTime() - dwTime << " ms" << endl;
+}
 
 #define _DIM_ 3
-auto __construct_covariance_matrix = [](const Eigen::VectorXd& cov) -> Eigen::MatrixXd
+auto __construct_covariance_matrix = [](const Eigen::Matrix<double, 6, 1>& cov) -> Eigen::Matrix3d
 {
-	Eigen::MatrixXd m(_DIM_, _DIM_);
+	Eigen::Matrix3d m;
 
 	for (std::size_t i = 0; i < _DIM_; ++i)
 	{
@@ -386,9 +476,9 @@ auto __construct_covariance_matrix = [](const Eigen::VectorXd& cov) -> Eigen::Ma
 
 	return m;
 };
-auto __diagonalize_selfadjoint_matrix = [](Eigen::MatrixXd& m, Eigen::MatrixXd& eigenvectors, Eigen::VectorXd& eigenvalues) -> bool
+auto __diagonalize_selfadjoint_matrix = [](Eigen::Matrix3d& m, Eigen::Matrix3d& eigenvectors, Eigen::Vector3d& eigenvalues) -> bool
 {
-	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigensolver;
+	Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver;
 
 	//eigensolver.computeDirect(m);
 	eigensolver.compute(m);
@@ -402,13 +492,13 @@ auto __diagonalize_selfadjoint_matrix = [](Eigen::MatrixXd& m, Eigen::MatrixXd&
 	return true;
 };
 auto __diagonalize_selfadjoint_covariance_matrix = [&]
-(const Eigen::VectorXd& cov, float* eigenvalues, __float3* eigenvectors)
+(const Eigen::Matrix<double, 6, 1>& cov, float* eigenvalues, __float3* eigenvectors)
 {
-	Eigen::MatrixXd m = __construct_covariance_matrix(cov);
+	Eigen::Matrix3d m = __construct_covariance_matrix(cov);
 
 	// Diagonalizing the matrix
-	Eigen::VectorXd eigenvalues_;
-	Eigen::MatrixXd eigenvectors_;
+	Eigen::Vector3d eigenvalues_;
+	Eigen::Matrix3d eigenvectors_;
 	bool res = __diagonalize_selfadjoint_matrix(m, eigenvectors_, eigenvalues_);
 
 	if (res)
@@ -425,9 +515,71 @@ auto __diagonalize_selfadjoint_covariance_matrix = [&]
 	return res;
 };
 
+// the last point set's kd-tree, matched by the vector, its buffer and a hash of its contents
+// so that a buffer refilled in place with a new frame is not mistaken for the old one
+static std::mutex __kdt_cache_mutex;
+static std::shared_ptr<point_kdtree> __kdt_cache;
+static const void* __kdt_cache_vector = NULL;
+static const void* __kdt_cache_buffer = NULL;
+static size_t __kdt_cache_size = 0;
+static unsigned long long __kdt_cache_hash = 0;
+
+unsigned long long hash_buffer_words(const void* ptr, const size_t num_bytes, unsigned long long hash)
+{
+	const unsigned int* words = (const unsigned int*)ptr;
+	const size_t num_words = num_bytes / sizeof(unsigned int);
+	for (size_t i = 0; i < num_words; i++)
+		hash = (hash ^ words[i]) * 1099511628211ull;
+	return hash;
+}
+
+std::shared_ptr<point_kdtree> acquire_point_kdtree(const std::vector<__float3>& pos_pts)
+{
+	DWORD dwTime = timeGetTime();
+	unsigned long long hash = hash_buffer_words(pos_pts.data(), pos_pts.size() * sizeof(__float3));
+
+	std::lock_guard<std::mutex> lock(__kdt_cache_mutex);
+	if (__kdt_cache && __kdt_cache_vector == &pos_pts && __kdt_cache_buffer == pos_pts.data()
+		&& __kdt_cache_size == pos_pts.size() && __kdt_cache_hash == hash)
+	{
+		cout << "==> kd tree reused : " << timeGetTime() - dwTime << " ms" << endl;
+		return __kdt_cache;
+	}
+
+	__kdt_cache.reset(); // free the old tree before building the new one
+	std::shared_ptr<point_kdtree> kdt = std::make_shared<point_kdtree>(pos_pts);
+	kdt->index.buildIndex();
+	cout << "==> kd tree build : " << timeGetTime() - dwTime << " ms" << endl;
+
+	__kdt_cache = kdt;
+	__kdt_cache_vector = &pos_pts;
+	__kdt_cache_buffer = pos_pts.data();
+	__kdt_cache_size = pos_pts.size();
+	__kdt_cache_hash = hash;
+	return kdt;
+}
+
+void clear_point_kdtree_cache()
+{
+	std::lock_guard<std::mutex> lock(__kdt_cache_mutex);
+	__kdt_cache.reset();
+	__kdt_cache_vector = __kdt_cache_buffer = NULL;
+	__kdt_cache_size = 0;
+	__kdt_cache_hash = 0;
+}
+
+// per-thread buffers of the per-pixel loops; they keep their capacity from pixel to pixel,
+// and nanoflann's radius search only clears the match buffer it is given before filling it
+struct alignas(64) __pixel_scratch
+{
+	std::vector<std::pair<size_t, float>> matches;
+	std::vector<__float3> pos_nbrs;
+	std::vector<float> weight_nbrs;
+};
+
 void normal_estimation(__float3* normalmap, __float3* eigenvaluemap, const int* indexmap, const byte* mask,
 	const int w, const int h, const std::vector<__float3>& pos_pts, 
-	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt)
+	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const point_kdtree* kdt)
 {
 	const int offset = nbr_pixel_offset;
 	memset(normalmap, 0, sizeof(__float3) * w*h);
@@ -435,13 +587,10 @@ void normal_estimation(__float3* normalmap, __float3* eigenvaluemap, const int*
 
 	DWORD dwTime;
 	nanoflann::SearchParams params;
-	PointCloud<float> pc_kdt(pos_pts);
-	kd_tree_t kdt_index(3, pc_kdt, nanoflann::KDTreeSingleIndexAdaptorParams(10));
+	std::shared_ptr<point_kdtree> kdt_cached;
 	if (use_kdt)
 	{
-		dwTime = timeGetTime();
-		kdt_index.buildIndex();
-		cout << "==> kd tree build : " << timeGetTime() - dwTime << " ms" << endl;
+		if (kdt == NULL) kdt_cached = acquire_point_kdtree(pos_pts), kdt = kdt_cached.get();
 		params.sorted = false;
 	}
 
@@ -450,6 +599,7 @@ void normal_estimation(__float3* normalmap, __float3* eigenvaluemap, const int*
 	dwTime = timeGetTime();
 	float r_sq = (float)(kernel_radius * kernel_radius);
 	int procs_cnt = omp_get_num_procs();
+	std::vector<__pixel_scratch> scratches(procs_cnt);
 #pragma omp parallel for num_threads( procs_cnt )
 	for (int y = 0; y < h; y++)
 	{
@@ -472,10 +622,11 @@ void normal_estimation(__float3* normalmap, __float3* eigenvaluemap, const int*
 			// just use knn search!!!
 			// ߿ 2D  ͸ óϴ  õ (̷ ϴ   ̵ ƴ ... Ÿ  ֺ kernel size  Ѵ..)
 
-			std::vector<std::pair<size_t, float>> ret_matches;
+			__pixel_scratch& scratch = scratches[tid];
+			std::vector<std::pair<size_t, float>>& ret_matches = scratch.matches;
 			int nMatches = 0;
 			if (use_kdt)
-				nMatches = (int)kdt_index.radiusSearch((float*)&pos_src, r_sq, ret_matches, params);
+				nMatches = (int)kdt->index.radiusSearch((float*)&pos_src, r_sq, ret_matches, params);
 			else
 			{
 				ret_matches.assign(((offset * 2) + 1) * ((offset * 2) + 1), std::pair<size_t, float>());
@@ -506,7 +657,7 @@ void normal_estimation(__float3* normalmap, __float3* eigenvaluemap, const int*
 
 			__float3 pos_centroid_f = __float3((float)pos_centroid.x, (float)pos_centroid.y, (float)pos_centroid.z);
 			//Eigen::VectorXd evecs(6); evecs << 0, 0, 0, 0, 0, 0;
-			Eigen::VectorXd evecs = Eigen::VectorXd::Zero(6);
+			Eigen::Matrix<double, 6, 1> evecs = Eigen::Matrix<double, 6, 1>::Zero();
 			for (int k = 0; k < nMatches; k++)
 			{
 				int idx_nb = (int)ret_matches[k].first;
@@ -568,65 +719,44 @@ void compute_coeff_bi_variate(double uvw_coeff[7], vmmat44f& mat_frame,
 	fMatrixWS2CS(&mat_frame, (vmfloat3*)&pos_center, &vec_proj_v, &vec_proj_w);
 
 	int num_pts = (int)pos_pts.size();
-	std::vector<__float3> pos_frame_pts(num_pts);
-	for (int i = 0; i < num_pts; i++)
-		fTransformPoint((vmfloat3*)&pos_frame_pts[i], (vmfloat3*)&pos_pts[i], &mat_frame);
 
 	vmfloat3 pos_frame_center;
 	fTransformPoint(&pos_frame_center, (vmfloat3*)&pos_center, &mat_frame);
 
+	// weighted least squares through its 6x6 normal equations, accumulated point by point
+	// B * BT and B * F of the (dim x num_pts) system, with B(j, i) = w * basis_j / w_sum and F(i) = w * w_coord / w_sum
 	const int dim = 6;
-	int solve_degree = num_pts;
-	Eigen::VectorXd F(solve_degree);
-	Eigen::MatrixXd B(dim, solve_degree);
+	typedef Eigen::Matrix<double, dim, dim> Matrix6d;
+	typedef Eigen::Matrix<double, dim, 1> Vector6d;
+	Matrix6d eM = Matrix6d::Zero();
+	Vector6d eB = Vector6d::Zero();
 	//const double cell_radius = width_cell * 0.5 * 1.732;
 	double w_sum = 0;
 
 	// typeB (6 dim): a0 + a1*u + a2*v + a3*u*v + a4*u*u + a5*v*v;
-	for (int i = 0; i < solve_degree; i++)
+	for (int i = 0; i < num_pts; i++)
 	{
-		vmdouble3 uvw = *(vmfloat3*)&pos_frame_pts[i];
+		vmfloat3 pos_frame;
+		fTransformPoint(&pos_frame, (vmfloat3*)&pos_pts[i], &mat_frame);
+		vmdouble3 uvw = pos_frame;
 
 		double w = weight_pts[i];// b_spline_weight((double)fLengthVector(&(uvw - pos_frame_center)), cell_radius);
 
-		F(i) = uvw.z * w;
-
-		B(0, i) = w * 1.;
-		B(1, i) = w * uvw.x;
-		B(2, i) = w * uvw.y;
-		B(3, i) = w * uvw.x * uvw.y;
-		B(4, i) = w * uvw.x * uvw.x;
-		B(5, i) = w * uvw.y * uvw.y;
+		Vector6d b;
+		b << 1., uvw.x, uvw.y, uvw.x * uvw.y, uvw.x * uvw.x, uvw.y * uvw.y;
+		eM.noalias() += (w * w) * b * b.transpose();
+		eB += (w * w * uvw.z) * b;
 		w_sum += w;
 	}
-
-	for (int i = 0; i < (int)pos_pts.size(); i++)
-	{
-		F(i) /= w_sum;
-		for (int j = 0; j < dim; j++) B(j, i) /= w_sum;
-	}
-
-	Eigen::MatrixXd BT = B;
-	BT.transposeInPlace();
+	eM /= w_sum * w_sum;
+	eB /= w_sum * w_sum;
 
 	const double regulaized_lamda = 0;// 0.00000000001;
-	//Eigen::MatrixXd M = B * BT;
-	Eigen::MatrixXd M = B * BT + regulaized_lamda * Eigen::MatrixXd::Identity(dim, dim);
-	Eigen::VectorXd _B = B * F;
-
-	Eigen::VectorXd eB(dim);
-	Eigen::MatrixXd eM(dim, dim);
-	for (int i = 0; i < dim; i++)
-	{
-		eB(i) = _B(i);
-		for (int j = 0; j < dim; j++)
-		{
-			eM(i, j) = M(i, j);
-		}
-	}
+	eM += regulaized_lamda * Matrix6d::Identity();
 
 	//Eigen::JacobiSVD<Eigen_matrix::EigenType> eigenSvd(eM.eigen_object(), ::Eigen::ComputeThinU | ::Eigen::ComputeThinV);
-	Eigen::BDCSVD<Eigen::MatrixXd> eigenSvd(eM, ::Eigen::ComputeThinU | ::Eigen::ComputeThinV);
+	// fixed-size matrices need full U and V, the same as thin ones for a square matrix
+	Eigen::JacobiSVD<Matrix6d> eigenSvd(eM, ::Eigen::ComputeFullU | ::Eigen::ComputeFullV);
 	eB = eigenSvd.solve(eB);
 	//cout << "SVD solver for quadratic fitting : " << eigenSvd.singularValues().array().abs().maxCoeff() /
 	//	eigenSvd.singularValues().array().abs().minCoeff() << endl;
@@ -796,7 +926,7 @@ void convert_uvw_xyz_coeffs(double xyz_coeff[10], const double uvw_coeff[7], con
 
 void curvature_estimation_ver1(__float2* curvaturemap, const int* indexmap, const __float3* normalmap, const byte* mask,
 	const int w, const int h, const std::vector<__float3>& pos_pts, 
-	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const bool use_numerical)
+	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const bool use_numerical, const point_kdtree* kdt)
 {
 	// umbrella curvature
 	const int offset = nbr_pixel_offset;
@@ -804,13 +934,10 @@ void curvature_estimation_ver1(__float2* curvaturemap, const int* indexmap, cons
 
 	DWORD dwTime;
 	nanoflann::SearchParams params;
-	PointCloud<float> pc_kdt(pos_pts);
-	kd_tree_t kdt_index(3, pc_kdt, nanoflann::KDTreeSingleIndexAdaptorParams(10));
+	std::shared_ptr<point_kdtree> kdt_cached;
 	if (use_kdt)
 	{
-		dwTime = timeGetTime();
-		kdt_index.buildIndex();
-		cout << "==> kd tree build : " << timeGetTime() - dwTime << " ms" << endl;
+		if (kdt == NULL) kdt_cached = acquire_point_kdtree(pos_pts), kdt = kdt_cached.get();
 		params.sorted = false;
 	}
 
@@ -819,6 +946,7 @@ void curvature_estimation_ver1(__float2* curvaturemap, const int* indexmap, cons
 	dwTime = timeGetTime();
 	float r_sq = (float)(kernel_radius * kernel_radius);
 	int procs_cnt = omp_get_num_procs();
+	std::vector<__pixel_scratch> scratches(procs_cnt);
 #pragma omp parallel for num_threads( procs_cnt )
 	for (int y = 0; y < h; y++)
 	{
@@ -839,10 +967,11 @@ void curvature_estimation_ver1(__float2* curvaturemap, const int* indexmap, cons
 
 			__float3 pos_src = pos_pts[idx];
 			// just use knn search!!!
-			std::vector<std::pair<size_t, float>> ret_matches;
+			__pixel_scratch& scratch = scratches[tid];
+			std::vector<std::pair<size_t, float>>& ret_matches = scratch.matches;
 			int nMatches = 0;
 			if (use_kdt)
-				nMatches = (int)kdt_index.radiusSearch((float*)&pos_src, r_sq, ret_matches, params);
+				nMatches = (int)kdt->index.radiusSearch((float*)&pos_src, r_sq, ret_matches, params);
 			else
 			{
 				ret_matches.assign(((offset * 2) + 1) * ((offset * 2) + 1), std::pair<size_t, float>());
@@ -861,8 +990,10 @@ void curvature_estimation_ver1(__float2* curvaturemap, const int* indexmap, cons
 			SELF_OP(nb_cnt_min, nMatches, min);
 			SELF_OP(nb_cnt_max, nMatches, max);
 
-			std::vector<__float3> pos_nbrs(nMatches);
-			std::vector<float> weight_nbrs(nMatches);
+			std::vector<__float3>& pos_nbrs = scratch.pos_nbrs;
+			std::vector<float>& weight_nbrs = scratch.weight_nbrs;
+			pos_nbrs.resize(nMatches);
+			weight_nbrs.resize(nMatches);
 			for (int k = 0; k < nMatches; k++)
 			{
 				pos_nbrs[k] = pos_pts[(int)ret_matches[k].first];
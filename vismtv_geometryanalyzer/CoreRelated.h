@@ -8,17 +8,46 @@ __vmstatic bool __core_function_launcher(VmFnContainer* _fncontainer, helpers_la
 #include <glm/gtc/constants.hpp>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <memory>
 
 void fill_organized_pointset_buffers(float* depthmap, int* indexmap, const int w, const int h, const glm::dmat4x4& mat_p, const std::vector<__float3>& pos_pts);
+// bvh over a triangle mesh, defined in MeshRaycast.cpp to keep the splitbvhlib headers there
+// pos_pts and tri_idx must stay alive and unchanged while it is in use
+struct mesh_bvh;
+// built bvh of the mesh; the last one is cached, so repeated calls for an unchanged mesh only hash it
+std::shared_ptr<mesh_bvh> acquire_mesh_bvh(const std::vector<__float3>& pos_pts, const std::vector<glm::ivec3>& tri_idx);
+void clear_mesh_bvh_cache();
+// indexmap : triangle index, barymap : weights of the triangle's 2nd and 3rd vertices (may be NULL)
+void fill_mesh_raycast_buffers(float* depthmap, int* indexmap, __float2* barymap, const int w, const int h,
+	const glm::dmat4x4& mat_p, const std::vector<__float3>& pos_pts, const std::vector<glm::ivec3>& tri_idx, const mesh_bvh* mbvh = NULL); // mbvh == NULL : acquire_mesh_bvh()
 void fill_rgb_matching_map(byte* rgbmap, const int* indexmap, const int w, const int h,
 	const byte* rgbimg, const int w1, const int h1,
 	const glm::dmat4x4& mat_p, const std::vector<__float3>& pos_pts);
+// skips points the rgb camera cannot see, judged by a z-buffer of all points from its viewpoint
+// visiblemap : 1 for colored pixels, 0 otherwise (may be NULL)
+void fill_rgb_matching_map_visible(byte* rgbmap, byte* visiblemap, const int* indexmap, const int w, const int h,
+	const byte* rgbimg, const int w1, const int h1,
+	const glm::dmat4x4& mat_p, const std::vector<__float3>& pos_pts, const float depth_tolerance);
 void compute_camera_matrix_p(glm::dmat4x4& mat_p, const double fx, const double fy, const double ppx, const double ppy, const glm::dmat3x3& rm, const glm::dvec3& tv);
 
+// kd-tree over a point set, built once and shared by normal_estimation and curvature_estimation_ver1
+// pos_pts must stay alive and unchanged while it is in use
+struct point_kdtree
+{
+	PointCloud<float> pc;
+	kd_tree_t index;
+	point_kdtree(const std::vector<__float3>& pos_pts) : pc(pos_pts), index(3, pc, nanoflann::KDTreeSingleIndexAdaptorParams(10)) {}
+};
+// built index of pos_pts; the last one is cached, so repeated calls for an unchanged point set only hash it
+std::shared_ptr<point_kdtree> acquire_point_kdtree(const std::vector<__float3>& pos_pts);
+void clear_point_kdtree_cache();
+// FNV-1a over the 32-bit words of a buffer, chained through hash; tells the cached trees' inputs apart
+unsigned long long hash_buffer_words(const void* ptr, const size_t num_bytes, unsigned long long hash = 14695981039346656037ull);
+
 void normal_estimation(__float3* normalmap, __float3* eigenvaluemap, const int* indexmap, const byte* mask,
 	const int w, const int h, const std::vector<__float3>& pos_pts,
-	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt);
+	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const point_kdtree* kdt = NULL); // kdt == NULL : acquire_point_kdtree()
 
 void curvature_estimation_ver1(__float2* curvaturemap, const int* indexmap, const __float3* normalmap, const byte* mask,
 	const int w, const int h, const std::vector<__float3>& pos_pts,
-	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const bool use_numerical);
+	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const bool use_numerical, const point_kdtree* kdt = NULL);
@@ -89,6 +89,15 @@ void fill_organized_pointset_buffers(float* depthmap, int* indexmap, const int w
 	//imwrite("d:\\window_result\\depthmap_rgb_from_realsense.jpg", img_depthmap);
 }
 
+void fill_mesh_raycast_buffers(float* depthmap, int* indexmap, void* barymap, const int w, const int h,
+	const void* mat_p, const void* pos_pts, const void* tri_idx)
+{
+	const glm::dmat4x4& m_p = *(const glm::dmat4x4*)mat_p;
+	const std::vector<__float3>& p_pts = *(const std::vector<__float3>*)pos_pts;
+	const std::vector<glm::ivec3>& t_idx = *(const std::vector<glm::ivec3>*)tri_idx;
+	fill_mesh_raycast_buffers(depthmap, indexmap, (__float2*)barymap, w, h, m_p, p_pts, t_idx);
+}
+
 void fill_rgb_matching_map(unsigned char* rgbmap, const int* indexmap, const int w, const int h,
 	const unsigned char* rgbimg, const int w1, const int h1, const void* mat_p, const void* pos_pts)
 {
@@ -101,6 +110,14 @@ void fill_rgb_matching_map(unsigned char* rgbmap, const int* indexmap, const int
 	//imwrite("d:\\window_result\\rgbmap_from_realsense.jpg", rgb_map);
 }
 
+void fill_rgb_matching_map_visible(unsigned char* rgbmap, unsigned char* visiblemap, const int* indexmap, const int w, const int h,
+	const unsigned char* rgbimg, const int w1, const int h1, const void* mat_p, const void* pos_pts, const float depth_tolerance)
+{
+	const glm::dmat4x4& m_p = *(const glm::dmat4x4*)mat_p;
+	const std::vector<__float3>& p_pts = *(const std::vector<__float3>*)pos_pts;
+	fill_rgb_matching_map_visible(rgbmap, visiblemap, indexmap, w, h, rgbimg, w1, h1, m_p, p_pts, depth_tolerance);
+}
+
 void compute_camera_matrix_p(void* mat_p, const double fx, const double fy, const double ppx, const double ppy,
 	const void* rm, const void* tv)
 {
@@ -133,4 +150,14 @@ void curvature_estimation_ver1(void* curvaturemap, const int* indexmap, const vo
 void fill_jet_colormap(int* clrmap, int size)
 {
 	___fill_jet_colormap(clrmap, size);
+}
+
+void release_point_kdtree_cache()
+{
+	clear_point_kdtree_cache();
+}
+
+void release_mesh_bvh_cache()
+{
+	clear_mesh_bvh_cache();
 }
\ No newline at end of file
@@ -27,6 +27,18 @@ __dojo_export void compute_camera_matrix_p(void* mat_p, const double fx, const d
 __dojo_export void fill_organized_pointset_buffers(float* depthmap, int* indexmap, const int w, const int h, 
 	const void* mat_p, const void* pos_pts);
 
+// :: make depth map by ray casting a triangle mesh (watertight, no pixel slips between triangles sharing an edge)
+// the bvh of the last mesh is kept and rebuilt only when pos_pts or tri_idx change
+// depthmap : depth (already allocated with w and h) buffer, 
+// indexmap : index (already allocated with w and h) buffer indexing tri_idx, -1 for background
+// barymap : glm::fvec2, barycentric weights of the hit triangle's 2nd and 3rd vertices (already allocated with w and h), can be NULL
+// w, h : buffer width and height,
+// mat_p : glm::dmat4x4, camera metrix (intrinsic and extrinsic), col-major,
+// pos_pts : mesh vertices ex. float3 array, 
+// tri_idx : mesh triangles ex. glm::ivec3 array indexing pos_pts, 
+__dojo_export void fill_mesh_raycast_buffers(float* depthmap, int* indexmap, void* barymap, const int w, const int h,
+	const void* mat_p, const void* pos_pts, const void* tri_idx);
+
 // :: make rgb map from rgb captured image 
 // rgbmap : rgb map buffer (already allocated with w and h) (output)
 // indexmap : index (already set) buffer indexing pos_pts, 
@@ -38,6 +50,19 @@ __dojo_export void fill_organized_pointset_buffers(float* depthmap, int* indexma
 __dojo_export void fill_rgb_matching_map(unsigned char* rgbmap, const int* indexmap, const int w, const int h,
 	const unsigned char* rgbimg, const int w1, const int h1, const void* mat_p, const void* pos_pts);
 
+// :: make rgb map from rgb captured image, skipping points occluded from the rgb camera
+// rgbmap : rgb map buffer (already allocated with w and h) (output), 0 for occluded pixels
+// visiblemap : flag map (already allocated with w and h) (output), 1 for colored pixels, can be NULL. usable as mask below
+// indexmap : index (already set) buffer indexing pos_pts, 
+// w, h : buffer width and height,
+// rgbimg : rgb captured image, 
+// w1, h1 : rgb captured image's width and height,
+// mat_p : glm::dmat4x4, camera metrix (intrinsic and extrinsic), col-major,
+// pos_pts : organized point set ex. float3 array, 
+// depth_tolerance : points farther than the nearest point on their rgb pixel by this (same unit as pos_pts) are occluded
+__dojo_export void fill_rgb_matching_map_visible(unsigned char* rgbmap, unsigned char* visiblemap, const int* indexmap, const int w, const int h,
+	const unsigned char* rgbimg, const int w1, const int h1, const void* mat_p, const void* pos_pts, const float depth_tolerance);
+
 // :: normal estimation through PCA 
 // normalmap : normal buffer (already allocated with w and h), glm::fvec3 (output)
 // eigenvaluemap : eigen value buffer (already allocated with w and h), glm::fvec3 (output), x<y<z
@@ -65,4 +90,11 @@ __dojo_export void normal_estimation(void* normalmap, void* eigenvaluemap, const
 // use_numerical : false ==> use finite difference for derivaties leading to smaller curvature-scales, 
 __dojo_export void curvature_estimation_ver1(void* curvaturemap, const int* indexmap, const void* normalmap, const unsigned char* mask,
 	const int w, const int h, const void* pos_pts,
-	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const bool use_numerical);
\ No newline at end of file
+	const double kernel_radius, const int nbr_pixel_offset, const bool use_kdt, const bool use_numerical);
+
+// :: free the kd-tree kept by normal_estimation and curvature_estimation_ver1
+// the estimators share the kd-tree of the last point set and rebuild it only when pos_pts changes
+__dojo_export void release_point_kdtree_cache();
+
+// :: free the bvh kept by fill_mesh_raycast_buffers
+__dojo_export void release_mesh_bvh_cache();
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "CoreRelated.h"
+#include "bvh/BVH.hpp"
+
+#include <iostream>
+#include <mutex>
+#include <omp.h>
+
+using namespace std;
+
+struct mesh_bvh
+{
+	std::unique_ptr<FW::BVH> bvh;
+	mesh_bvh(const std::vector<__float3>& pos_pts, const std::vector<glm::ivec3>& tri_idx)
+	{
+		// the bvh keeps its own copy of the scene descriptor, the buffers stay with the caller
+		FW::SceneBVH scene((FW::Vec3i*)&tri_idx[0], (FW::Vec3f*)&pos_pts[0], (FW::S32)tri_idx.size(), (FW::S32)pos_pts.size());
+		FW::Platform platform;
+		FW::BVH::BuildParams params;
+		bvh.reset(new FW::BVH(&scene, platform, params));
+	}
+};
+
+// the last mesh's bvh, matched like the kd-tree cache of the point sets
+static std::mutex __bvh_cache_mutex;
+static std::shared_ptr<mesh_bvh> __bvh_cache;
+static const void* __bvh_cache_vectors[2] = { NULL, NULL };
+static const void* __bvh_cache_buffers[2] = { NULL, NULL };
+static size_t __bvh_cache_sizes[2] = { 0, 0 };
+static unsigned long long __bvh_cache_hash = 0;
+
+std::shared_ptr<mesh_bvh> acquire_mesh_bvh(const std::vector<__float3>& pos_pts, const std::vector<glm::ivec3>& tri_idx)
+{
+	DWORD dwTime = timeGetTime();
+	unsigned long long hash = hash_buffer_words(pos_pts.data(), pos_pts.size() * sizeof(__float3));
+	hash = hash_buffer_words(tri_idx.data(), tri_idx.size() * sizeof(glm::ivec3), hash);
+
+	std::lock_guard<std::mutex> lock(__bvh_cache_mutex);
+	if (__bvh_cache && __bvh_cache_vectors[0] == &pos_pts && __bvh_cache_vectors[1] == &tri_idx
+		&& __bvh_cache_buffers[0] == pos_pts.data() && __bvh_cache_buffers[1] == tri_idx.data()
+		&& __bvh_cache_sizes[0] == pos_pts.size() && __bvh_cache_sizes[1] == tri_idx.size() && __bvh_cache_hash == hash)
+	{
+		cout << "==> bvh reused : " << timeGetTime() - dwTime << " ms" << endl;
+		return __bvh_cache;
+	}
+
+	__bvh_cache.reset(); // free the old bvh before building the new one
+	std::shared_ptr<mesh_bvh> mbvh = std::make_shared<mesh_bvh>(pos_pts, tri_idx);
+	cout << "==> bvh build : " << timeGetTime() - dwTime << " ms" << endl;
+
+	__bvh_cache = mbvh;
+	__bvh_cache_vectors[0] = &pos_pts, __bvh_cache_vectors[1] = &tri_idx;
+	__bvh_cache_buffers[0] = pos_pts.data(), __bvh_cache_buffers[1] = tri_idx.data();
+	__bvh_cache_sizes[0] = pos_pts.size(), __bvh_cache_sizes[1] = tri_idx.size();
+	__bvh_cache_hash = hash;
+	return mbvh;
+}
+
+void clear_mesh_bvh_cache()
+{
+	std::lock_guard<std::mutex> lock(__bvh_cache_mutex);
+	__bvh_cache.reset();
+	__bvh_cache_vectors[0] = __bvh_cache_vectors[1] = NULL;
+	__bvh_cache_buffers[0] = __bvh_cache_buffers[1] = NULL;
+	__bvh_cache_sizes[0] = __bvh_cache_sizes[1] = 0;
+	__bvh_cache_hash = 0;
+}
+
+// depth and index maps by ray casting the mesh instead of splatting its vertices,
+// so every pixel gets the nearest surface behind it without holes between the points
+void fill_mesh_raycast_buffers(float* depthmap, int* indexmap, __float2* barymap, const int w, const int h,
+	const glm::dmat4x4& mat_p, const std::vector<__float3>& pos_pts, const std::vector<glm::ivec3>& tri_idx, const mesh_bvh* mbvh)
+{
+	const float max_depth = 1000000.f;
+	for (int i = 0; i < w*h; i++) depthmap[i] = max_depth, indexmap[i] = -1;
+	if (barymap) memset(barymap, 0, sizeof(__float2) * w*h);
+	if (tri_idx.size() == 0 || pos_pts.size() == 0) return;
+
+	std::shared_ptr<mesh_bvh> mbvh_cached;
+	if (mbvh == NULL) mbvh_cached = acquire_mesh_bvh(pos_pts, tri_idx), mbvh = mbvh_cached.get();
+	const FW::BVH& bvh = *mbvh->bvh;
+
+	// mat_p maps (x, y, z, 1) to (u * d, v * d, d, 1) with d the depth,
+	// so with these rays the hit distance t is the depth itself
+	glm::dmat4x4 mat_p_inv = glm::inverse(mat_p);
+	glm::dvec4 org = mat_p_inv * glm::dvec4(0, 0, 0, 1.0);
+	glm::dvec4 dir_x = mat_p_inv * glm::dvec4(1.0, 0, 0, 0);
+	glm::dvec4 dir_y = mat_p_inv * glm::dvec4(0, 1.0, 0, 0);
+	glm::dvec4 dir_0 = mat_p_inv * glm::dvec4(0.5, 0.5, 1.0, 0); // pixel (0, 0) center
+
+	DWORD dwTime = timeGetTime();
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			glm::dvec4 dir = dir_0 + dir_x * (double)x + dir_y * (double)y;
+
+			FW::Ray ray;
+			ray.origin = FW::Vec3f((float)org.x, (float)org.y, (float)org.z);
+			ray.direction = FW::Vec3f((float)dir.x, (float)dir.y, (float)dir.z);
+			ray.tmin = 0;
+			ray.tmax = max_depth;
+
+			// watertight, so no ray slips through an edge shared by two triangles
+			FW::RayResult result;
+			bvh.trace(ray, result, true, NULL, true);
+			if (!result.hit()) continue;
+
+			int ipix = x + y * w;
+			depthmap[ipix] = result.t;
+			indexmap[ipix] = result.id;
+
+			// weights of the 2nd and 3rd vertices
+			if (barymap)
+			{
+				barymap[ipix].x = result.u;
+				barymap[ipix].y = result.v;
+			}
+		}
+	}
+	cout << "==> mesh ray casting : " << timeGetTime() - dwTime << " ms" << endl;
+}